@@ -20,160 +20,668 @@
 //
 
 #include "anisotropicdiffusionfilter.h"
+#include <cpufeatures.h>
+#include <DS/threadpool.h>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <type_traits>
 
-bool AnisotropicDiffusionFilter::filter(Vol3D<uint8> &vOut, const Vol3D<uint8> &vIn, int verbosity)
+CPU_INLINE int square(const int a) { return a*a; }
+CPU_INLINE float sqf(const float a) { return a*a; }
+template <class T> CPU_INLINE float diff(const T a, const T b) { return float(a)-float(b); }
+
+// Reference row kernel. z holds the row pointers for slices z-2, z-1, z, z+1, z+2.
+// The conductances are read from the lookup table C and the arithmetic matches
+// the original single-voxel implementation exactly.
+static void adfRowScalar(uint8 *out, const uint8 *const *z, const int yStride, const int n,
+                         const float *C, const float /*timestep*/, const float /*scale*/)
+{
+  const uint8 *zb2 = z[0];
+  const uint8 *zb  = z[1];
+  const uint8 *cptr= z[2];
+  const uint8 *zt  = z[3];
+  const uint8 *zt2 = z[4];
+  for (int j=0; j<n; j++, zb2++, zb++, cptr++, zt++, zt2++)
+  {
+    uint8 c0 = *cptr;
+    float Ce=C[square(int(cptr[2]-c0))
+              +square(int(cptr[yStride+1]-cptr[-yStride+1]))
+              +square(int(zt[1]-zb[1]))];
+    float Cw=C[square(int(c0-cptr[-2]))
+              +square(int(cptr[yStride-1]-cptr[-yStride-1]))
+              +square(int(zt[-1]-zb[-1]))];
+    float Cn=C[square(int(cptr[2*yStride]-c0))
+              +square(int(cptr[yStride+1]-cptr[yStride-1]))
+              +square(int(zt[yStride]-zb[yStride]))];
+    float Cs=C[square(int(c0-cptr[-2*yStride]))
+              +square(int(cptr[-yStride+1]-cptr[-yStride-1]))
+              +square(int(zt[-yStride]-zb[-yStride]))];
+    float Ct=C[square(int(*zt2-c0))
+              +square(int(zt[yStride]-zt[-yStride]))
+              +square(int(zt[1]-zt[-1]))];
+    float Cb=C[square(int(c0-*zb2))
+              +square(int(zb[yStride]-zb[-yStride]))
+              +square(int(zb[1]-zb[-1]))];
+    out[j] = c0 + (char)(
+               (Ce*int(cptr[2]-c0)
+               -Cw*int(c0-cptr[-2])
+               +Cn*int(cptr[2*yStride]-c0)
+               -Cs*int(c0-cptr[-2*yStride])
+               +Ct*int(*zt2-c0)
+               -Cb*int(c0-*zb2)));
+  }
+}
+
+// exp(x) for -87<=x<=0, accurate to a few ulp; written so that it vectorizes.
+CPU_INLINE float expNonPositive(const float x)
+{
+  const int k = (int)(x*-1.44269504088896341f + 0.5f);
+  const float r = (x + k*0.693359375f) + k*-2.12194440e-4f;
+  float p = 1.9875691500E-4f;
+  p = p*r + 1.3981999507E-3f;
+  p = p*r + 8.3334519073E-3f;
+  p = p*r + 4.1665795894E-2f;
+  p = p*r + 1.6666665459E-1f;
+  p = p*r + 5.0000001201E-1f;
+  p = p*r*r + r + 1.0f;
+  return p * std::bit_cast<float>((127-k)<<23);
+}
+
+// Vectorizable row kernel. Computes the conductances directly instead of gathering
+// them from the table, which lets the compiler process a full register of voxels
+// per step. This is compiled once per instruction set below.
+CPU_INLINE void adfRowVector(uint8 * __restrict out, const uint8 *const *z, const int yStride, const int n,
+                             const float timestep, const float scale)
 {
-  std::vector<float> C(3*255*255+1);
-  for(int i=0; i<=3*255*255; i++)
-    C[i] = timestep*(float)exp((double)(-i) /(double)(diffusion*diffusion));
+  const uint8 * __restrict zb2 = z[0];
+  const uint8 * __restrict zb  = z[1];
+  const uint8 * __restrict c   = z[2];
+  const uint8 * __restrict zt  = z[3];
+  const uint8 * __restrict zt2 = z[4];
+  const int ys = yStride;
+  // gradient magnitudes are clamped so that the exponent stays within the range of expNonPositive
+  const int gmax = (int)std::min(87.0f/-scale,3.0f*255*255);
+  for (int j=0; j<n; j++)
+  {
+    const int c0 = c[j];
+    const int dE = c[j+2]-c0;
+    const int dW = c0-c[j-2];
+    const int dN = c[j+2*ys]-c0;
+    const int dS = c0-c[j-2*ys];
+    const int dT = zt2[j]-c0;
+    const int dB = c0-zb2[j];
+    const int gE = std::min(dE*dE + square(c[j+ys+1]-c[j-ys+1]) + square(zt[j+1]-zb[j+1]),gmax);
+    const int gW = std::min(dW*dW + square(c[j+ys-1]-c[j-ys-1]) + square(zt[j-1]-zb[j-1]),gmax);
+    const int gN = std::min(dN*dN + square(c[j+ys+1]-c[j+ys-1]) + square(zt[j+ys]-zb[j+ys]),gmax);
+    const int gS = std::min(dS*dS + square(c[j-ys+1]-c[j-ys-1]) + square(zt[j-ys]-zb[j-ys]),gmax);
+    const int gT = std::min(dT*dT + square(zt[j+ys]-zt[j-ys]) + square(zt[j+1]-zt[j-1]),gmax);
+    const int gB = std::min(dB*dB + square(zb[j+ys]-zb[j-ys]) + square(zb[j+1]-zb[j-1]),gmax);
+    const float update =
+        timestep*expNonPositive(gE*scale)*dE
+      - timestep*expNonPositive(gW*scale)*dW
+      + timestep*expNonPositive(gN*scale)*dN
+      - timestep*expNonPositive(gS*scale)*dS
+      + timestep*expNonPositive(gT*scale)*dT
+      - timestep*expNonPositive(gB*scale)*dB;
+    out[j] = (uint8)(c0 + (int)update);
+  }
+}
+
+// Row kernel for 16-bit and floating point volumes. The gradients are computed in float
+// since their squares exceed the range of int for 16-bit data.
+template <class T> CPU_INLINE T adfResult(const float c0, const float update) { return (T)(c0 + update); }
+template <> CPU_INLINE uint16 adfResult(const float c0, const float update) { return (uint16)((int)c0 + (int)update); }
+
+template <class T>
+CPU_INLINE void adfRowFloat(T * __restrict out, const T *const *z, const int yStride, const int n,
+                            const float timestep, const float scale)
+{
+  const T * __restrict zb2 = z[0];
+  const T * __restrict zb  = z[1];
+  const T * __restrict c   = z[2];
+  const T * __restrict zt  = z[3];
+  const T * __restrict zt2 = z[4];
+  const int ys = yStride;
+  const float gmax = 87.0f/-scale;
+  for (int j=0; j<n; j++)
+  {
+    const T c0 = c[j];
+    const float dE = diff(c[j+2],c0);
+    const float dW = diff(c0,c[j-2]);
+    const float dN = diff(c[j+2*ys],c0);
+    const float dS = diff(c0,c[j-2*ys]);
+    const float dT = diff(zt2[j],c0);
+    const float dB = diff(c0,zb2[j]);
+    const float gE = std::min(dE*dE + sqf(diff(c[j+ys+1],c[j-ys+1])) + sqf(diff(zt[j+1],zb[j+1])),gmax);
+    const float gW = std::min(dW*dW + sqf(diff(c[j+ys-1],c[j-ys-1])) + sqf(diff(zt[j-1],zb[j-1])),gmax);
+    const float gN = std::min(dN*dN + sqf(diff(c[j+ys+1],c[j+ys-1])) + sqf(diff(zt[j+ys],zb[j+ys])),gmax);
+    const float gS = std::min(dS*dS + sqf(diff(c[j-ys+1],c[j-ys-1])) + sqf(diff(zt[j-ys],zb[j-ys])),gmax);
+    const float gT = std::min(dT*dT + sqf(diff(zt[j+ys],zt[j-ys])) + sqf(diff(zt[j+1],zt[j-1])),gmax);
+    const float gB = std::min(dB*dB + sqf(diff(zb[j+ys],zb[j-ys])) + sqf(diff(zb[j+1],zb[j-1])),gmax);
+    const float update =
+        timestep*expNonPositive(gE*scale)*dE
+      - timestep*expNonPositive(gW*scale)*dW
+      + timestep*expNonPositive(gN*scale)*dN
+      - timestep*expNonPositive(gS*scale)*dS
+      + timestep*expNonPositive(gT*scale)*dT
+      - timestep*expNonPositive(gB*scale)*dB;
+    out[j] = adfResult<T>(float(c0),update);
+  }
+}
+
+CPU_TARGET_AVX512 static void adfRowAVX512(uint8 *out, const uint8 *const *z, const int yStride, const int n,
+                                           const float * /*C*/, const float timestep, const float scale)
+{
+  adfRowVector(out,z,yStride,n,timestep,scale);
+}
+
+CPU_TARGET_AVX2 static void adfRowAVX2(uint8 *out, const uint8 *const *z, const int yStride, const int n,
+                                       const float * /*C*/, const float timestep, const float scale)
+{
+  adfRowVector(out,z,yStride,n,timestep,scale);
+}
+
+template <class T>
+CPU_TARGET_AVX512 static void adfRowFloatAVX512(T *out, const T *const *z, const int yStride, const int n,
+                                                const float * /*C*/, const float timestep, const float scale)
+{
+  adfRowFloat(out,z,yStride,n,timestep,scale);
+}
+
+template <class T>
+CPU_TARGET_AVX2 static void adfRowFloatAVX2(T *out, const T *const *z, const int yStride, const int n,
+                                            const float * /*C*/, const float timestep, const float scale)
+{
+  adfRowFloat(out,z,yStride,n,timestep,scale);
+}
+
+template <class T>
+static void adfRowFloatScalar(T *out, const T *const *z, const int yStride, const int n,
+                              const float * /*C*/, const float timestep, const float scale)
+{
+  adfRowFloat(out,z,yStride,n,timestep,scale);
+}
+
+AnisotropicDiffusionFilter::InstructionSet AnisotropicDiffusionFilter::instructionSet() const
+{
+  if (kernel==Scalar) return ScalarISA;
+  if (CPUFeatures::hasAVX512()) return AVX512;
+  if (CPUFeatures::hasAVX2()) return AVX2;
+  return ScalarISA;
+}
+
+template <>
+AnisotropicDiffusionFilter::RowKernel<uint8> AnisotropicDiffusionFilter::selectKernel<uint8>() const
+{
+  switch (instructionSet())
+  {
+    case AVX512 : return adfRowAVX512;
+    case AVX2 : return adfRowAVX2;
+    default : return adfRowScalar;
+  }
+}
+
+template <class T>
+AnisotropicDiffusionFilter::RowKernel<T> AnisotropicDiffusionFilter::selectKernel() const
+{
+  switch (instructionSet())
+  {
+    case AVX512 : return adfRowFloatAVX512<T>;
+    case AVX2 : return adfRowFloatAVX2<T>;
+    default : return adfRowFloatScalar<T>;
+  }
+}
+
+std::string AnisotropicDiffusionFilter::kernelName() const
+{
+  switch (instructionSet())
+  {
+    case AVX512 : return "AVX-512";
+    case AVX2 : return "AVX2";
+    default : return "scalar";
+  }
+}
+
+template <class T>
+static void accumulateChanges(AnisotropicDiffusionFilter::IterationStats &stats, const T *after, const T *before, const int n)
+{
+  if constexpr (std::is_integral<T>::value)
+  {
+    // integer reductions vectorize without reassociating floating point sums
+    int maxUpdate = 0;
+    int64_t sumUpdate = 0;
+    int changed = 0;
+    for (int j=0; j<n; j++)
+    {
+      const int d = std::abs(int(after[j])-int(before[j]));
+      maxUpdate = std::max(maxUpdate,d);
+      sumUpdate += d;
+      changed += (d!=0);
+    }
+    stats.maxUpdate = std::max(stats.maxUpdate,(double)maxUpdate);
+    stats.sumUpdate += (double)sumUpdate;
+    stats.changed += changed;
+  }
+  else
+  {
+    double maxUpdate = 0;
+    double sumUpdate = 0;
+    int changed = 0;
+    for (int j=0; j<n; j++)
+    {
+      const double d = std::fabs(double(after[j])-double(before[j]));
+      maxUpdate = std::max(maxUpdate,d);
+      sumUpdate += d;
+      changed += (d>0);
+    }
+    stats.maxUpdate = std::max(stats.maxUpdate,maxUpdate);
+    stats.sumUpdate += sumUpdate;
+    stats.changed += changed;
+  }
+  stats.count += n;
+}
+
+// Bricks of the volume that contain tissue, dilated by the distance that the stencil
+// propagates values over all iterations. The active bricks are stored as x ranges for each
+// row of bricks.
+class ActiveRegion {
+public:
+  static const int brickSize = 8;
+  typedef std::vector<std::pair<int,int>> Spans;
+  template <class T> void build(const Vol3D<T> &vIn, const float noiseFloor, const int radius);
+  const Spans &spans(const int y, const int z) const { return rowSpans[(z/brickSize)*nby + y/brickSize]; }
+  int nBricks=0;
+  int nActive=0;
+private:
+  int nbx=0, nby=0, nbz=0;
+  std::vector<Spans> rowSpans;
+};
+
+template <class T>
+void ActiveRegion::build(const Vol3D<T> &vIn, const float noiseFloor, const int radius)
+{
+  const int cx = (int)vIn.cx;
+  const int cy = (int)vIn.cy;
+  const int cz = (int)vIn.cz;
+  nbx = (cx+brickSize-1)/brickSize;
+  nby = (cy+brickSize-1)/brickSize;
+  nbz = (cz+brickSize-1)/brickSize;
+  nBricks = nbx*nby*nbz;
+  std::vector<uint8> occupied(nBricks,0);
+  for (int z=0;z<cz;z++)
+    for (int y=0;y<cy;y++)
+    {
+      const T *row = vIn.start() + (size_t)z*cx*cy + (size_t)y*cx;
+      uint8 *brick = &occupied[((z/brickSize)*nby + y/brickSize)*nbx];
+      for (int x=0;x<cx;x++)
+        if (float(row[x])>noiseFloor) brick[x/brickSize] = 1;
+    }
+  const int r = (radius+brickSize-1)/brickSize;
+  std::vector<uint8> active(nBricks,0);
+  for (int bz=0;bz<nbz;bz++)
+    for (int by=0;by<nby;by++)
+      for (int bx=0;bx<nbx;bx++)
+      {
+        if (!occupied[(bz*nby+by)*nbx+bx]) continue;
+        for (int z=std::max(0,bz-r);z<=std::min(nbz-1,bz+r);z++)
+          for (int y=std::max(0,by-r);y<=std::min(nby-1,by+r);y++)
+            for (int x=std::max(0,bx-r);x<=std::min(nbx-1,bx+r);x++)
+              active[(z*nby+y)*nbx+x] = 1;
+      }
+  nActive = 0;
+  rowSpans.assign(nby*nbz,Spans());
+  for (int b=0;b<nby*nbz;b++)
+  {
+    const uint8 *a = &active[b*nbx];
+    for (int bx=0;bx<nbx;)
+    {
+      if (!a[bx]) { bx++; continue; }
+      const int start = bx;
+      while (bx<nbx && a[bx]) bx++;
+      nActive += bx-start;
+      rowSpans[b].push_back(std::make_pair(start*brickSize,std::min(cx,bx*brickSize)));
+    }
+  }
+}
+
+// Fused iterations keep a ring of slices each; see runWavefront.
+static const int ringSlices = 6;
+
+int AnisotropicDiffusionFilter::sweepIterations(const size_t sliceBytes) const
+{
+  if (blockIterations>0) return std::min(blockIterations,nIterations);
+  // each fused iteration keeps a ring of slices in cache
+  const int n = (int)(cacheBytes/(ringSlices*sliceBytes));
+  return std::max(1,std::min(n,nIterations));
+}
+
+// Applies one diffusion iteration to rows of a zero-padded slice.
+// The padded volume holds slices 0..cz+1, with the data in slices 1..cz.
+// Padded slice 1 (the first data slice) is never updated and stays zero in the output.
+// The original implementation filtered padded slice 3 at x=1,2 with the slice two below
+// treated as zero; that behavior is retained here.
+template <class T>
+class ADFSliceFilter {
+public:
+  typedef AnisotropicDiffusionFilter::IterationStats Stats;
+  ADFSliceFilter(const AnisotropicDiffusionFilter::RowKernel<T> kernel_, const std::vector<float> &C_, const float timestep_,
+                 const float scale_, const int cx_, const int cy_, const int cz_, const ActiveRegion *activeRegion_=nullptr) :
+    cx(cx_), cy(cy_), cz(cz_), Imax(cy_-3), Jmax(cx_-3), slicesize(cx_*cy_), firstSlice(std::min(2,cz_)),
+    kernel(kernel_), C(C_), timestep(timestep_), scale(scale_), activeRegion(activeRegion_), zeroSlice(slicesize,0)
+  {
+  }
+  const T *zero() const { return zeroSlice.data(); }
+  // src holds the slices p-2..p+2 of the previous iteration. In sparse mode, inactive voxels
+  // are copied from src if copyInactive is set and are otherwise left untouched.
+  void filterSlice(T *dst, const T *const *src, const int p, const int i0, const int i1, Stats *stats, const bool copyInactive) const
+  {
+    if (p==3 && cz>=4)
+    {
+      const T *srcQ[5] = { zero(), src[1], src[2], src[3], src[4] };
+      filterRows(dst,srcQ,p,1,std::min(2,Jmax-3),i0,i1,stats,copyInactive);
+    }
+    filterRows(dst,src,p,3,Jmax-3,i0,i1,stats,copyInactive);
+  }
+  // Slice buffers that are reused for other slices may still hold the x=1,2 values of slice 3.
+  void clearFirstSliceBorder(T *dst, const int p, const int i0, const int i1) const
+  {
+    if (p==3 || cz<4) return;
+    for (int i=i0; i<i1; i++)
+      std::fill_n(dst+i*cx+1,std::max(0,std::min(2,Jmax-3)),T(0));
+  }
+  // The output buffer is never written outside the filtered region. After the first
+  // iteration the input buffer is reused as an output buffer, so its borders are cleared.
+  void clearBorders(T *buffer) const
+  {
+    std::fill_n(buffer,firstSlice*slicesize,T(0));
+    std::fill_n(buffer+(cz+1)*slicesize,slicesize,T(0));
+    const int x1 = std::max(Jmax,3);
+    for (int p=firstSlice; p<=cz; p++)
+      for (int i=0; i<cy; i++)
+      {
+        T *row = buffer + p*slicesize + i*cx;
+        if (i<3 || i>=Imax)
+          std::fill_n(row,cx,T(0));
+        else
+        {
+          std::fill_n(row,std::min(3,cx),T(0));
+          if (x1<cx) std::fill_n(row+x1,cx-x1,T(0));
+        }
+      }
+  }
+  const int cx, cy, cz;
+  const int Imax, Jmax;
+  const int slicesize;
+  const int firstSlice;
+private:
+  void filterRows(T *dst, const T *const *src, const int p, const int x0, const int nx, const int i0, const int i1,
+                  Stats *stats, const bool copyInactive) const
+  {
+    if (nx<=0) return;
+    const T *z[5];
+    for (int i=i0; i<i1; i++)
+    {
+      if (!activeRegion)
+      {
+        const int offset = i*cx + x0;
+        for (int k=0; k<5; k++) z[k] = src[k] + offset;
+        kernel(dst + offset,z,cx,nx,C.data(),timestep,scale);
+        if (stats) accumulateChanges(*stats,dst+offset,z[2],nx);
+        continue;
+      }
+      if (copyInactive) std::copy_n(src[2]+i*cx+x0,nx,dst+i*cx+x0);
+      for (auto &span : activeRegion->spans(i,p-1))
+      {
+        const int xa = std::max(span.first,x0);
+        const int xb = std::min(span.second,x0+nx);
+        if (xa>=xb) continue;
+        const int offset = i*cx + xa;
+        for (int k=0; k<5; k++) z[k] = src[k] + offset;
+        kernel(dst + offset,z,cx,xb-xa,C.data(),timestep,scale);
+        if (stats) accumulateChanges(*stats,dst+offset,z[2],xb-xa);
+      }
+    }
+  }
+  const AnisotropicDiffusionFilter::RowKernel<T> kernel;
+  const std::vector<float> &C;
+  const float timestep;
+  const float scale;
+  const ActiveRegion *activeRegion;
+  const std::vector<T> zeroSlice;
+};
+
+// Applies nLevels iterations in a single pass over the padded slices. Iteration k trails
+// iteration k-1 by 3 slices, so every iteration in a step can be filtered in parallel:
+// iteration k reads slices p-2..p+2 of iteration k-1 while that iteration writes slice p+3.
+// Intermediate iterations are kept in rings of ringSlices slices. input(p) returns slice p of
+// the unfiltered volume, output(p) returns the buffer for slice p of the last iteration,
+// prepare(step) is called before each step, and finished(p) is called in order once slice p
+// of the last iteration is complete.
+template <class T>
+static bool runWavefront(ThreadPool &pool, const ADFSliceFilter<T> &sf, const int nLevels,
+                         const std::function<const T *(const int p)> &input,
+                         const std::function<T *(const int p)> &output,
+                         const std::function<bool(const int step)> &prepare,
+                         const std::function<bool(const int p)> &finished)
+{
+  const int firstSlice = sf.firstSlice;
+  const int cz = sf.cz;
+  std::vector<T> ring((nLevels-1)*ringSlices*(size_t)sf.slicesize,0);
+  auto levelSlice = [&](const int level, const int p) -> T *
+  {
+    if (p<firstSlice || p>cz) return const_cast<T *>(sf.zero());
+    return ring.data() + ((level-1)*ringSlices + p%ringSlices)*(size_t)sf.slicesize;
+  };
+  const int nSteps = cz - firstSlice + 1 + 3*(nLevels-1);
+  std::vector<int> levels(nLevels);
+  for (int step=0; step<nSteps; step++)
+  {
+    if (!prepare(step)) return false;
+    int nActive = 0;
+    for (int k=1; k<=nLevels; k++)
+    {
+      const int p = firstSlice + step - 3*(k-1);
+      if (p>=firstSlice && p<=cz) levels[nActive++] = k;
+    }
+    if (nActive==0) continue; // thin volumes leave gaps between the iterations
+    const int rowBlocks = std::max(1,(2*pool.size()+nActive-1)/nActive);
+    const int rowsPerBlock = (sf.Imax-3+rowBlocks-1)/rowBlocks;
+    pool.run(nActive*rowBlocks,[&](const int task, const int)
+    {
+      const int k = levels[task/rowBlocks];
+      const int p = firstSlice + step - 3*(k-1);
+      const int i0 = 3 + (task%rowBlocks)*rowsPerBlock;
+      const int i1 = std::min(sf.Imax,i0+rowsPerBlock);
+      if (i0>=i1) return;
+      const T *src[5];
+      for (int j=0; j<5; j++) src[j] = (k==1) ? input(p-2+j) : levelSlice(k-1,p-2+j);
+      T *dst = (k==nLevels) ? output(p) : levelSlice(k,p);
+      sf.clearFirstSliceBorder(dst,p,i0,i1);
+      sf.filterSlice(dst,src,p,i0,i1,nullptr,false);
+    });
+    const int p = firstSlice + step - 3*(nLevels-1);
+    if (p>=firstSlice && !finished(p)) return false;
+  }
+  return true;
+}
+
+template <class T>
+std::vector<float> AnisotropicDiffusionFilter::conductanceTable() const
+{
+  // the conductance table is only used by the scalar 8-bit kernel
+  std::vector<float> C;
+  if (std::is_same<T,uint8>::value)
+  {
+    C.resize(3*255*255+1);
+    for(int i=0; i<=3*255*255; i++)
+      C[i] = timestep*(float)exp((double)(-i) /(double)(diffusion*diffusion));
+  }
+  return C;
+}
+
+template <class T>
+bool AnisotropicDiffusionFilter::filter(Vol3D<T> &vOut, const Vol3D<T> &vIn, int verbosity)
+{
+  const std::vector<float> C = conductanceTable<T>();
+  const float scale = -1.0f/(diffusion*diffusion);
   const int cx = vIn.cx;
   const int cy = vIn.cy;
   const int cz = vIn.cz;
-  const int Kmax  = cz;
-  const int Imax  = cy - 3;
-  const int Jmax  = cx - 3;
   const int slicesize = cx*cy;
-  const int zStride = slicesize;
-  const int yStride = cx;
   const int datasize  = vIn.size();
-  const int z2 = 2 * slicesize;
-  float Ce=0, Cw=0, Cn=0, Cs=0, Ct=0, Cb=0;
-  uint8 *cptr=0;
+  // Each iteration moves values by at most two voxels, so voxels farther than 2*nIterations
+  // from the active bricks cannot affect the result inside them.
+  const bool sparse = (noiseFloor>=0);
+  ActiveRegion activeRegion;
+  if (sparse) activeRegion.build(vIn,noiseFloor,2*nIterations);
+  const ADFSliceFilter<T> sf(selectKernel<T>(),C,timestep,scale,cx,cy,cz,sparse ? &activeRegion : nullptr);
+  const int firstSlice = sf.firstSlice;
+  const bool adaptive = (tolerance>=0);
+  // fusing iterations needs enough slices to fill the wavefront
+  const int blockSize = (cz>=4 && !sparse && !adaptive) ? sweepIterations(slicesize*sizeof(T)) : 1;
+  const int nSweeps = (nIterations+blockSize-1)/blockSize;
+  if (verbosity>1)
+  {
+    std::cout<<"Anisotropic diffusion filter using "<<kernelName()<<" kernel and "<<pool().size()<<" threads"<<std::endl;
+    std::cout<<"Anisotropic diffusion filter: "<<nIterations<<" iterations in "<<nSweeps<<" sweeps of up to "<<blockSize
+             <<" iterations, "<<2*nSweeps*sizeof(T)<<" bytes moved per voxel"<<std::endl;
+    if (sparse)
+      std::cout<<"Anisotropic diffusion filter: "<<activeRegion.nActive<<" of "<<activeRegion.nBricks<<" bricks active"<<std::endl;
+  }
 
-  uint8 *In  = (new uint8[datasize + 2 * slicesize]);
-  uint8 *Out = (new uint8[datasize + 2 * slicesize]);
+  T *In  = (new T[datasize + 2 * slicesize]);
+  T *Out = (new T[datasize + 2 * slicesize]);
   // zero-pad the volume
-  memset(In, 0, slicesize);
-  memcpy(In + slicesize,vIn.start(),datasize);
-  memset(In + slicesize + datasize, 0, slicesize);
+  std::fill_n(In, slicesize, T(0));
+  std::copy_n(vIn.start(), datasize, In + slicesize);
+  std::fill_n(In + slicesize + datasize, slicesize, T(0));
 
-  memset(Out, 0, slicesize+datasize+slicesize); // required to pass valgrind checks
+  std::fill_n(Out, slicesize+datasize+slicesize, T(0)); // required to pass valgrind checks
 
-  for (int n=0; n<nIterations; n++)
+  auto paddedSlice = [&](const T *buffer, const int p) -> const T *
   {
+    return (p>=0 && p<=cz+1) ? buffer + p*slicesize : sf.zero();
+  };
+  ThreadPool &pool = this->pool();
+  iterationStats.clear();
+  std::vector<IterationStats> workerStats;
+  int n=0;
+  for (int sweep=0; sweep<nSweeps; sweep++)
+  {
+    const int nLevels = std::min(blockSize,nIterations-n);
     if (verbosity>1)
     {
-      std::cout<<"Anisotropic Filter "<<n+1<<std::endl;
+      for (int k=0; k<nLevels; k++)
+        std::cout<<"Anisotropic Filter "<<n+k+1<<std::endl;
     }
-    int index2 = vIn.index(1,3,3);    // as seen here, where the indices are
-    cptr = In + index2;								// offset by one.  This could be fixed.
-    for (int i=3; i<Imax; i++)
+    if (nLevels==1)
     {
-      for (int j=3; j<Jmax; j++)
+      // each task filters one slice; the slices only read In, so they can be processed in any order
+      workerStats.assign(adaptive ? pool.size() : 0,IterationStats());
+      pool.run(cz-firstSlice+1,[&](const int task, const int worker)
       {
-        uint8 c0 = *cptr;
-        Ce=C[(square(int(cptr[2]                           -c0))
-           +square(int(cptr[yStride + 1]-cptr[- yStride + 1]))
-            +square(int(cptr[zStride + 1]-cptr[- zStride + 1])))];
-        Cw=C[(square(int(c0               -cptr[-2           ]))
-           +square(int(cptr[yStride - 1]-cptr[-yStride - 1]) )
-            +square(int(cptr[zStride - 1]-cptr[-zStride - 1]) ))];
-        Cn=C[(square(int(cptr[2*yStride  ]-                 c0))
-           +square(int(cptr[  yStride+1]-cptr[ yStride-1]))
-            +square(int(cptr[ zStride+yStride]-cptr[-zStride+yStride])))];
-        Cs=C[(square(int(c0-cptr[-2*yStride]))
-           +square(int(cptr[-yStride+1]-cptr[-yStride-1]))
-            +square(int(cptr[ zStride-yStride]-cptr[-zStride-yStride])))];
-        Ct=C[(square(int(cptr[z2]-c0))
-              +square(int(cptr[ zStride+yStride]-cptr[ zStride-yStride]))
-            +square(int(cptr[ zStride+1]-cptr[ zStride-1])))];
-        Cb=C[(square(int(c0))
-              +square(int(cptr[-zStride+yStride]-cptr[-zStride-yStride]))
-            +square(int(cptr[-zStride+1]-cptr[-zStride-1])))];
-        Out[index2++] = c0 + (char)(
-                          (Ce*int(cptr[2]-c0)
-                          -Cw*int(c0-cptr[-2])
-                        +Cn*int(cptr[2*yStride]-c0)
-            -Cs*int(c0-cptr[-2*yStride])
-            +Ct*int(cptr[z2]-c0)
-            -Cb*int(c0)));
-        cptr++;
-      }
-      cptr += 6;
-      index2 += 6;
+        const int p = firstSlice + task;
+        const T *src[5];
+        for (int k=0; k<5; k++) src[k] = paddedSlice(In,p-2+k);
+        // in sparse mode, inactive voxels are copied on the first iteration and keep their values
+        // in both buffers afterwards
+        sf.filterSlice(Out+p*slicesize,src,p,3,sf.Imax,adaptive ? &workerStats[worker] : nullptr,n==0);
+      });
     }
-    for (int k=1; k<Kmax-1; k++)
+    else
     {
-      int index2 = vIn.index(3,3,k+1);
-      cptr = In + index2;
-      for (int i=3; i<Imax; i++)
-      {
-        for (int j=3; j<Jmax; j++)
-        {
-          uint8 c0 = *cptr;
-          Ce= C[square(int(cptr[2]                           -c0))
-              +square(int(cptr[yStride + 1]-cptr[- yStride + 1]))
-              +square(int(cptr[zStride + 1]-cptr[- zStride + 1]))];
-          Cw=C[square(int(c0               -cptr[-2           ]))
-              +square(int(cptr[yStride - 1]-cptr[-yStride - 1]))
-              +square(int(cptr[zStride - 1]-cptr[-zStride - 1]))];
-          Cn=C[square(int(cptr[2*yStride  ]-                 c0))
-              +square(int(cptr[  yStride+1]-cptr[ yStride-1]))
-              +square(int(cptr[ zStride+yStride]-cptr[-zStride+yStride]))];
-          Cs=C[square(int(c0-cptr[-2*yStride]))
-              +square(int(cptr[-yStride+1]-cptr[-yStride-1]))
-              +square(int(cptr[ zStride-yStride]-cptr[-zStride-yStride]))];
-          Ct=C[square(int(cptr[z2]-c0))
-             +square(int(cptr[ zStride+yStride]-cptr[ zStride-yStride]))
-              +square(int(cptr[ zStride+1]-cptr[ zStride-1]))];
-          Cb=C[square(int(c0-cptr[-z2]))
-              +square(int(cptr[-zStride+yStride]-cptr[-zStride-yStride]))
-              +square(int(cptr[-zStride+1]-cptr[-zStride-1]))];
-          Out[index2++] = c0 + (char)(
-                            (Ce*int(cptr[2]-c0)
-                            -Cw*int(c0-cptr[-2])
-                          +Cn*int(cptr[2*yStride]-c0)
-              -Cs*int(c0-cptr[-2*yStride])
-              +Ct*int(cptr[z2]-c0)
-              -Cb*int(c0-cptr[-z2])));
-          cptr++;
-        }
-        cptr += 6;
-        index2 += 6;
-      }
+      runWavefront<T>(pool,sf,nLevels,
+                      [&](const int p) { return paddedSlice(In,p); },
+                      [&](const int p) { return Out + p*slicesize; },
+                      [](const int) { return true; },
+                      [](const int) { return true; });
     }
-    index2 = vIn.index(3,3,Kmax);
-    cptr = In + index2;
-    for (int i=3; i<Imax; i++)
+    n += nLevels;
+    if (adaptive)
     {
-      for (int j=3; j<Jmax; j++)
-      {
-        uint8 c0 = *cptr;
-        Ce=C[(square(int(cptr[2]                           -c0))
-           +square(int(cptr[yStride + 1]-cptr[- yStride + 1]))
-            +square(int(cptr[zStride + 1]-cptr[- zStride + 1])))];
-        Cw=C[(square(int(c0               -cptr[-2           ]))
-           +square(int(cptr[yStride - 1]-cptr[-yStride - 1]) )
-            +square(int(cptr[zStride - 1]-cptr[-zStride - 1]) ))];
-        Cn=C[(square(int(cptr[2*yStride  ]-                 c0))
-           +square(int(cptr[  yStride+1]-cptr[ yStride-1]))
-            +square(int(cptr[ zStride+yStride]-cptr[-zStride+yStride])))];
-        Cs=C[(square(int(c0-cptr[-2*yStride]))
-           +square(int(cptr[-yStride+1]-cptr[-yStride-1]))
-            +square(int(cptr[ zStride-yStride]-cptr[-zStride-yStride])))];
-        Ct=C[(square(int(c0))
-              +square(int(cptr[ zStride+yStride]-cptr[ zStride-yStride]))
-            +square(int(cptr[ zStride+1]-cptr[ zStride-1])))];
-        Cb=C[(square(int(c0-cptr[-z2]))
-           +square(int(cptr[-zStride+yStride]-cptr[-zStride-yStride]))
-            +square(int(cptr[-zStride+1]-cptr[-zStride-1])))];
-        Out[index2++] = c0 + (char)(
-                          (Ce*int(cptr[2]-c0)
-                          -Cw*int(c0-cptr[-2])
-                        +Cn*int(cptr[2*yStride]-c0)
-            -Cs*int(c0-cptr[-2*yStride])
-            +Ct*int(-c0)
-            -Cb*int(c0-cptr[-z2])));
-        cptr++;
-      }
-      cptr += 6;
-      index2 += 6;
+      IterationStats stats;
+      for (auto &w : workerStats) stats.add(w);
+      iterationStats.push_back(stats);
+      if (verbosity>1)
+        std::cout<<"Anisotropic Filter "<<n<<": max update "<<stats.maxUpdate<<", mean update "<<stats.meanUpdate()
+                 <<", "<<stats.changed<<" voxels changed"<<std::endl;
+      if (stats.meanUpdate()<=tolerance) break;
+    }
+    if (n<nIterations)
+    {
+      if (sweep==0) sf.clearBorders(In);
+      std::swap(In,Out);
     }
-    if (n!=(nIterations-1)) memcpy(In,Out,datasize+2*slicesize);
   }
+  iterationsRun = n;
+  if (verbosity>1 && adaptive)
+    std::cout<<"Anisotropic diffusion filter stopped after "<<n<<" of "<<nIterations<<" iterations"<<std::endl;
   delete[] In;
   vOut.makeCompatible(vIn);
-  memcpy(vOut.start(),Out+slicesize,datasize);
+  std::copy_n(Out+slicesize,datasize,vOut.start());
   delete[] Out;
   return true;
 }
+
+template <class T>
+bool AnisotropicDiffusionFilter::filterStream(const int cx, const int cy, const int cz, const SliceReader<T> &read,
+                                              const SliceWriter<T> &write, int verbosity)
+{
+  const int slicesize = cx*cy;
+  iterationStats.clear();
+  iterationsRun = 0;
+  if (nIterations<=0)
+  {
+    std::vector<T> slice(slicesize);
+    for (int z=0; z<cz; z++)
+      if (!read(slice.data(),z) || !write(slice.data(),z)) return false;
+    return true;
+  }
+  const std::vector<float> C = conductanceTable<T>();
+  const ADFSliceFilter<T> sf(selectKernel<T>(),C,timestep,-1.0f/(diffusion*diffusion),cx,cy,cz);
+  if (verbosity>1)
+  {
+    std::cout<<"Anisotropic diffusion filter using "<<kernelName()<<" kernel and "<<pool().size()<<" threads"<<std::endl;
+    std::cout<<"Anisotropic diffusion filter: streaming "<<nIterations<<" iterations through "<<(nIterations+1)*ringSlices
+             <<" slices"<<std::endl;
+  }
+  // padded slice p is stored in slot p%ringSlices once it has been read
+  std::vector<T> inputRing(ringSlices*(size_t)slicesize,0);
+  std::vector<T> outputRing(ringSlices*(size_t)slicesize,0);
+  int nRead = 0;
+  auto input = [&](const int p) -> const T *
+  {
+    return (p>=1 && p<=cz) ? inputRing.data() + (p%ringSlices)*(size_t)slicesize : sf.zero();
+  };
+  auto prepare = [&](const int step)
+  {
+    // the first iteration reads up to two slices ahead of the slice it filters
+    const int needed = std::min(cz,sf.firstSlice+step+2);
+    for (; nRead<needed; nRead++)
+      if (!read(inputRing.data() + ((nRead+1)%ringSlices)*(size_t)slicesize,nRead)) return false;
+    return true;
+  };
+  auto output = [&](const int p) { return outputRing.data() + (p%ringSlices)*(size_t)slicesize; };
+  auto finished = [&](const int p)
+  {
+    if (verbosity>2) std::cout<<"Anisotropic diffusion filter: wrote slice "<<p-1<<std::endl;
+    return write(output(p),p-1);
+  };
+  // padded slice 1 is not filtered
+  if (sf.firstSlice==2 && !write(sf.zero(),0)) return false;
+  if (!runWavefront<T>(pool(),sf,nIterations,input,output,prepare,finished)) return false;
+  iterationsRun = nIterations;
+  return true;
+}
+
+template bool AnisotropicDiffusionFilter::filter(Vol3D<uint8> &vOut, const Vol3D<uint8> &vIn, int verbosity);
+template bool AnisotropicDiffusionFilter::filter(Vol3D<uint16> &vOut, const Vol3D<uint16> &vIn, int verbosity);
+template bool AnisotropicDiffusionFilter::filter(Vol3D<float32> &vOut, const Vol3D<float32> &vIn, int verbosity);
+template bool AnisotropicDiffusionFilter::filterStream(const int cx, const int cy, const int cz, const SliceReader<uint8> &read,
+                                                       const SliceWriter<uint8> &write, int verbosity);
+template bool AnisotropicDiffusionFilter::filterStream(const int cx, const int cy, const int cz, const SliceReader<uint16> &read,
+                                                       const SliceWriter<uint16> &write, int verbosity);
+template bool AnisotropicDiffusionFilter::filterStream(const int cx, const int cy, const int cz, const SliceReader<float32> &read,
+                                                       const SliceWriter<float32> &write, int verbosity);
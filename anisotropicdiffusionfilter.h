@@ -23,16 +23,74 @@
 #define AnisotropicDiffusionFilter_H
 
 #include <vol3d.h>
+#include <DS/threadpool.h>
+#include <functional>
 
 class AnisotropicDiffusionFilter {
 public:
+  // Scalar uses the exact conductance lookup table. Auto uses the vectorized kernel when
+  // the CPU supports AVX2 or AVX-512, which computes the conductances with a polynomial
+  // exp and agrees with Scalar to within one gray level; otherwise it uses Scalar.
+  enum Kernel { Auto=0, Scalar=1 };
   template <class T> inline T square(const T &t) { return t*t; }
   AnisotropicDiffusionFilter(const int nIterations_=3, const float diffusion_=25.0f, const float timestep_=0.125f) :
+    kernel(Auto), blockIterations(0), cacheBytes(defaultCacheBytes), noiseFloor(-1.0f),
+    tolerance(-1.0f), iterationsRun(0), threadPool(nullptr),
     nIterations(nIterations_), diffusion(diffusion_), timestep(timestep_)
   {
   }
-  bool filter(Vol3D<uint8> &vOut, const Vol3D<uint8> &vIn, int verbosity);
+  // T may be uint8, uint16 or float32. The 8-bit filter reproduces the original implementation;
+  // the 16-bit and float filters use the same stencil with float arithmetic.
+  template <class T> bool filter(Vol3D<T> &vOut, const Vol3D<T> &vIn, int verbosity);
+  // Streaming interface for volumes that do not fit in memory. read(slice,z) is called for
+  // z=0..cz-1 in order and must fill slice with cx*cy voxels; write(slice,z) receives the
+  // filtered slices in the same order. All iterations are fused into one pass, so only
+  // about 6*(nIterations+1) slices are held in memory. The output matches filter, but the
+  // noiseFloor and tolerance settings are not used. Returns false if read or write fails.
+  template <class T> using SliceReader = std::function<bool(T *slice, const int z)>;
+  template <class T> using SliceWriter = std::function<bool(const T *slice, const int z)>;
+  template <class T> bool filterStream(const int cx, const int cy, const int cz, const SliceReader<T> &read,
+                                       const SliceWriter<T> &write, int verbosity);
+  std::string kernelName() const;
+  Kernel kernel;
+  // Number of iterations fused into each pass over the volume (0=choose from cacheBytes,
+  // 1=one pass per iteration). Fused passes produce the same output.
+  int blockIterations;
+  size_t cacheBytes;
+  static const size_t defaultCacheBytes = 4<<20;
+  // If noiseFloor>=0, the stencil is only applied near 8x8x8 bricks that contain a voxel above
+  // noiseFloor; other voxels keep their input values. Voxels above the noise floor are filtered
+  // exactly as in the full filter. Iterations are not fused in this mode.
+  float noiseFloor;
+  // Change statistics of one iteration.
+  class IterationStats {
+  public:
+    IterationStats() : maxUpdate(0), sumUpdate(0), changed(0), count(0) {}
+    double meanUpdate() const { return count ? sumUpdate/count : 0; }
+    void add(const IterationStats &s)
+    {
+      maxUpdate = std::max(maxUpdate,s.maxUpdate); sumUpdate += s.sumUpdate; changed += s.changed; count += s.count;
+    }
+    double maxUpdate;
+    double sumUpdate;
+    size_t changed;
+    size_t count;
+  };
+  // If tolerance>=0, the statistics are gathered during each iteration and filtering stops once
+  // the mean absolute update is at or below tolerance. Iterations are not fused in this mode.
+  float tolerance;
+  int iterationsRun; // number of iterations performed by the last call to filter
+  std::vector<IterationStats> iterationStats;
+  ThreadPool *threadPool; // pool that runs the filter (nullptr uses ThreadPool::global())
+  ThreadPool &pool() const { return threadPool ? *threadPool : ThreadPool::global(); }
+  template <class T> using RowKernel = void (*)(T *out, const T *const *z, const int yStride, const int n,
+                                                const float *C, const float timestep, const float scale);
 protected:
+  enum InstructionSet { ScalarISA, AVX2, AVX512 };
+  InstructionSet instructionSet() const;
+  template <class T> RowKernel<T> selectKernel() const;
+  int sweepIterations(const size_t sliceBytes) const;
+  template <class T> std::vector<float> conductanceTable() const;
   int nIterations;
   float diffusion;
   float timestep;
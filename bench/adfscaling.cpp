@@ -0,0 +1,69 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Times the diffusion filter on a 512x512x400 volume with thread pools of 1..N threads and
+// reports the speedup over one thread. Run with "make bench".
+// usage: adfscaling [maxThreads [cx cy cz [iterations]]]
+
+#include "anisotropicdiffusionfilter.h"
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+int main(int argc, char *argv[])
+{
+  const int maxThreads = (argc>1) ? atoi(argv[1]) : ThreadPool::defaultThreadCount();
+  const int cx = (argc>4) ? atoi(argv[2]) : 512;
+  const int cy = (argc>4) ? atoi(argv[3]) : 512;
+  const int cz = (argc>4) ? atoi(argv[4]) : 400;
+  const int nIterations = (argc>5) ? atoi(argv[5]) : 3;
+  if (maxThreads<1 || cx<1 || cy<1 || cz<1 || nIterations<1)
+  {
+    std::cerr<<"usage: "<<argv[0]<<" [maxThreads [cx cy cz [iterations]]]"<<std::endl;
+    return 1;
+  }
+  Vol3D<uint8> vIn, vOut;
+  vIn.setsize(cx,cy,cz);
+  for (int z=0,i=0;z<cz;z++)
+    for (int y=0;y<cy;y++)
+      for (int x=0;x<cx;x++,i++)
+        vIn[i] = (uint8)(128 + 60*std::sin(x*0.05f)*std::cos(y*0.07f) + 30*std::sin(z*0.11f) + (i*2654435761u>>27));
+  AnisotropicDiffusionFilter filter(nIterations,25.0f,0.125f);
+  std::cout<<"diffusion ("<<filter.kernelName()<<" kernel, "<<nIterations<<" iterations) on "<<cx<<"x"<<cy<<"x"<<cz<<std::endl;
+  std::cout<<"threads\tseconds\tspeedup"<<std::endl;
+  double baseTime = 0;
+  for (int nThreads=1;nThreads<=maxThreads;nThreads++)
+  {
+    ThreadPool threadPool(nThreads);
+    filter.threadPool = &threadPool;
+    const auto start = std::chrono::steady_clock::now();
+    if (!filter.filter(vOut,vIn,0))
+    {
+      std::cerr<<"filter failed with "<<nThreads<<" threads"<<std::endl;
+      return 1;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    if (nThreads==1) baseTime = seconds;
+    std::cout<<nThreads<<'\t'<<std::fixed<<std::setprecision(3)<<seconds<<'\t'<<std::setprecision(2)<<baseTime/seconds<<std::endl;
+  }
+  return 0;
+}
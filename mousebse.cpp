@@ -21,7 +21,9 @@
 #include <vol3dlib.h>
 #include <vol3dsimple.h>
 #include <DS/timer.h>
+#include <DS/threadpool.h>
 #include <volumeloader.h>
+#include <strutil.h>
 #include "mousebseparser.h"
 #include "mousebsetool.h"
 
@@ -75,9 +77,21 @@ MouseBSEParser::MouseBSEParser(MouseBSETool &mouseBSE) : ArgParserBase("mousebse
   bind("-zpad",zpad,"nslices","zeropad the image by nslices");
   bind("d",mouseBSE.settings.diffusionConstant,"<float>","diffusion constant",false);
   bind("n",mouseBSE.settings.diffusionIterations,"<iterations>","diffusion iterations",false);
+  bindFlag("-adfnative",mouseBSE.settings.nativeDiffusion,"filter 16-bit and float volumes without converting them to 8 bits");
+  bind("-adftol",mouseBSE.settings.diffusionTolerance,"<value>","stop diffusion once the mean absolute update falls to value (<0 runs all iterations)",false);
+  bind("-adffloor",mouseBSE.settings.diffusionNoiseFloor,"<value>","only filter near voxels brighter than value (<0 filters everything)",false);
+  bind("-adfblock",mouseBSE.settings.diffusionBlocking,"<iterations>","diffusion iterations per pass over the volume (0=auto, 1=no blocking)",false);
   bind("s",mouseBSE.settings.edgeConstant,"<edge sigma>","edge detection constant",false);
+  bindFlag("-edgelegacy",mouseBSE.settings.legacyEdgeFilter,"use the original double-precision edge detection filter");
+  bindFlag("-edgeiir",mouseBSE.settings.recursiveEdgeFilter,"use recursive Gaussian filters for edge detection (faster for large sigma)");
+  bindFlag("-edgehalf",mouseBSE.settings.halfEdgeStorage,"store edge detection intermediates as 16-bit floats (halves their memory)");
+  bind("-sweep",sweep,"<s1,s2,...>","run once for each edge sigma in the list, writing a mask per sigma (requires --mask)",false);
   bind("r",mouseBSE.settings.erosionSize,"<size>","radius of erosion/dilation filter",false);
   bind("c",closingSize,"<size>","closing size",false);
+  bindFlag("-cball",closingBall,"close with a Euclidean ball of radius <size> instead of alternating cube/diamond steps");
+  bind("-rmm",mouseBSE.settings.erosionRadiusMM,"<mm>","radius in mm of erosion/dilation filter, used instead of -r",false);
+  bind("-cmm",closingMM,"<mm>","closing radius in mm, used instead of -c and --cball",false);
+  bindFlag("-mmbox",mouseBSE.settings.boxElements,"use boxes rather than ellipsoids for --rmm and --cmm");
   bind("p",mouseBSE.settings.dilateFinalMask,"dilation_radius","dilate final mask by dilation_radius (0==don't dilate)");
 //  bindFlag("-trim",mouseBSE.settings.removeBrainstem,"trim brainstem");
   bind("-mask",mfname,"<filename>","save smooth brain mask",false);
@@ -90,6 +104,7 @@ MouseBSEParser::MouseBSEParser(MouseBSETool &mouseBSE) : ArgParserBase("mousebse
 //  bind("-cortex",cortexFilename,"<filename>","cortex file",false);
   bind("v",mouseBSE.settings.verbosity,"<number>","verbosity level (0=silent)",false);
 //  bind("-neckfile",noneckFilename,"<filename>","save image after neck removal",false,true);
+  bind("-threads",ThreadPool::defaultThreads,"<n>","number of threads (0=use all available)",false);
   bindFlag("-norotate",Vol3DBase::noRotate,"retain original orientation (default behavior will auto-rotate input NII files to RAS orientation");
   example = progname + " -i input_mri.img -o skull_stripped_mri.img";
 }
@@ -103,7 +118,105 @@ bool writeByte(std::string ofname, Vol3D<VBit> &vBit)
 
 void status(std::string s) { std::cout<<s<<std::endl; }
 
-double regionMean(Vol3DBase *vIn, Vol3D<uint8> &vMask);
+// Inserts label before the extension of fname, e.g., mask.nii.gz becomes mask_s0.75.nii.gz.
+std::string sweepFilename(const std::string &fname, const std::string &label)
+{
+  const std::string basename = StrUtil::getBasename(fname);
+  return basename + label + fname.substr(basename.length());
+}
+
+int writeEdgeMask(const std::string &ofname, Vol3D<VBit> &edgeMask, const int verbosity)
+{
+  if (!writeByte(ofname,edgeMask)) return ::CommonErrors::cantWrite(ofname);
+  if (verbosity>0) std::cout<<"Wrote edge mask "<<ofname<<std::endl;
+  return 0;
+}
+
+int writeMask(const std::string &ofname, Vol3D<uint8> &maskVolume, const int verbosity)
+{
+  std::ostringstream description;
+  maskVolume.description = description.str();
+  if (!maskVolume.write(ofname)) return ::CommonErrors::cantWrite(ofname);
+  if (verbosity>0) std::cout<<"Wrote mask file "<<ofname<<std::endl;
+  return 0;
+}
+
+// Finds the brain in the edge map held in mouseBSE.edgemask and leaves its mask in maskVolume.
+// label is appended to the names of the intermediate output files (see sweepFilename).
+// One half of the closing: the closingMM element, the closingBall ball, or closingSize
+// alternating diamond/cube steps.
+bool applyClosingElement(Morph32 &morphology, Vol3D<VBit> &v, const MouseBSEParser &ap, const MouseBSETool::Settings &settings,
+                         const bool dilate)
+{
+  bool ok = true;
+  if (settings.verbosity>1) std::cout<<(dilate ? "dilating " : "eroding ")<<ap.closingSize<<" : ";
+  if (ap.closingMM>0)
+  {
+    const Morph32::Shape shape = settings.boxElements ? Morph32::Box : Morph32::Ellipsoid;
+    const float r = ap.closingMM;
+    if (settings.verbosity>1) std::cout<<r<<"mm";
+    ok = dilate ? morphology.dilateMM(v,shape,r,r,r) : morphology.erodeMM(v,shape,r,r,r);
+  }
+  else if (ap.closingBall)
+  {
+    if (settings.verbosity>1) std::cout<<"ball";
+    ok = dilate ? morphology.dilateBall(v,(float)ap.closingSize) : morphology.erodeBall(v,(float)ap.closingSize);
+  }
+  else
+  {
+    const std::string steps = Morph32::alternating(ap.closingSize); // alternate diamond/cube
+    if (settings.verbosity>1) std::cout<<steps;
+    ok = dilate ? morphology.dilate(v,steps) : morphology.erode(v,steps);
+  }
+  if (settings.verbosity>1) std::cout<<"\n";
+  return ok;
+}
+
+void findBrainMask(Vol3D<uint8> &maskVolume, MouseBSETool &mouseBSE, const MouseBSEParser &ap, const Vol3DBase *referenceVolume,
+                   Vol3D<uint8> &vCroppedMask, int &retcode, const std::string &label)
+{
+  if (mouseBSE.settings.verbosity>1) { std::cout<<"Eroding brain"<<std::endl; }
+  if (!mouseBSE.erodeBrain(mouseBSE.settings.erosionSize)) { std::cerr<<"error in eroding brain";
+    //return 1;
+  }
+  if (mouseBSE.settings.verbosity>1) { std::cout<<"Eroded brain"<<std::endl; }
+
+  if (ap.erodedMaskFilename.empty()==false)
+  {
+    Vol3D<uint8> edgeMap;
+    mouseBSE.erodedBrain.decode(edgeMap);
+    const std::string erodedMaskFilename = sweepFilename(ap.erodedMaskFilename,label);
+    if (writeByte(erodedMaskFilename,mouseBSE.edgemask))
+    {
+      if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote edge mask "<<erodedMaskFilename<<std::endl;
+    }
+    else
+    {
+      retcode |= ::CommonErrors::cantWrite(ap.edgeFilename);
+    }
+  }
+  // now we diverge!
+
+  mouseBSE.concom(referenceVolume,mouseBSE.erodedBrain,vCroppedMask);
+  {
+    Morph32 morphology;
+    morphology.setup(mouseBSE.erodedBrain);
+    mouseBSE.applyErosionElement(morphology,mouseBSE.erodedBrain,mouseBSE.settings.erosionSize,true);
+    if (!ap.initBrainFilename.empty()) writeByte(sweepFilename(ap.initBrainFilename,label),mouseBSE.erodedBrain);
+    applyClosingElement(morphology,mouseBSE.erodedBrain,ap,mouseBSE.settings,true);
+    RunLengthSegmenter rls;
+    rls.segmentBG(mouseBSE.erodedBrain);
+    applyClosingElement(morphology,mouseBSE.erodedBrain,ap,mouseBSE.settings,false);
+    if (mouseBSE.settings.dilateFinalMask>0)
+    {
+      if (mouseBSE.settings.verbosity>0) std::cout<<"dilating final mask ";
+      mouseBSE.applyErosionElement(morphology,mouseBSE.erodedBrain,mouseBSE.settings.erosionSize,true);
+      if (mouseBSE.settings.verbosity>0) std::cout<<"\n";
+    }
+    mouseBSE.erodedBrain.decode(maskVolume);
+  }
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -159,139 +272,61 @@ int main(int argc, char *argv[])
   int retcode = 0;
   Vol3D<uint8> maskVolume;
   {
-    Vol3D<uint8> edgeMap;
     {
-      if (mouseBSE.settings.verbosity>1) { std::cout<<"Performing anisotropic diffusion filter"<<std::endl; }
-      if (!mouseBSE.initialize(referenceVolume, vIn.get())) return 1;
-      if (ap.adfFilename.empty()==false)
+      // unless the filtered volume is needed, the diffusion filter feeds the edge detector directly
+      // and is run again for the region statistics rather than storing its output
+      const bool streaming = ap.adfFilename.empty() && ap.sweepSigmas.empty() && mouseBSE.canStreamEdges();
+      if (streaming)
       {
-        if (referenceVolume->write(ap.adfFilename))
-        {
-          if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote anisotropic diffusion filtered volume "<<ap.adfFilename<<std::endl;
-        }
-        else
-        {
-          retcode |= ::CommonErrors::cantWrite(ap.adfFilename);
-        }
+        if (mouseBSE.settings.verbosity>1) { std::cout<<"Performing anisotropic diffusion filter and edge detection"<<std::endl; }
+        if (!mouseBSE.streamEdges(vIn.get())) return 1;
       }
-      if (mouseBSE.settings.verbosity>1) { std::cout<<"Performing edge detection"<<std::endl; }
-      if (!mouseBSE.edgeDetect(maskVolume,referenceVolume,mouseBSE.settings.edgeConstant)) return 1;
-      if (ap.edgeFilename.empty()==false)
+      else
       {
-        mouseBSE.edgemask.decode(edgeMap);
-        if (writeByte(ap.edgeFilename,mouseBSE.edgemask))
-        {
-          if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote edge mask "<<ap.edgeFilename<<std::endl;
-        }
-        else
-        {
-          retcode |= ::CommonErrors::cantWrite(ap.edgeFilename);
-        }
-      }
-      if (mouseBSE.settings.verbosity>1) { std::cout<<"Eroding brain"<<std::endl; }
-      if (!mouseBSE.erodeBrain(maskVolume,mouseBSE.settings.erosionSize)) { std::cerr<<"error in eroding brain";
-        //return 1;
-      }
-      if (mouseBSE.settings.verbosity>1) { std::cout<<"Eroded brain"<<std::endl; }
-
-      if (ap.erodedMaskFilename.empty()==false)
-      {
-        mouseBSE.erodedBrain.decode(edgeMap);
-        if (writeByte(ap.erodedMaskFilename,mouseBSE.edgemask))
-        {
-          if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote edge mask "<<ap.erodedMaskFilename<<std::endl;
-        }
-        else
+        if (mouseBSE.settings.verbosity>1) { std::cout<<"Performing anisotropic diffusion filter"<<std::endl; }
+        if (!mouseBSE.initialize(referenceVolume, vIn.get())) return 1;
+        if (ap.adfFilename.empty()==false)
         {
-          retcode |= ::CommonErrors::cantWrite(ap.edgeFilename);
-        }
-      }
-      // now we diverge!
-
-      std::cout<<"cropped region mean is "<<regionMean(referenceVolume,vCroppedMask)<<std::endl;
-      mouseBSE.concom(referenceVolume,mouseBSE.erodedBrain);
-      {
-        Morph32 morphology;
-        morphology.setup(mouseBSE.erodedBrain);
-        for (int i=0;i<mouseBSE.settings.erosionSize;i++)
-        {
-          if (i&1) // alternate cube/diamond
+          if (referenceVolume->write(ap.adfFilename))
           {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'C';
-            morphology.dilateC(mouseBSE.erodedBrain);
+            if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote anisotropic diffusion filtered volume "<<ap.adfFilename<<std::endl;
           }
           else
           {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'D';
-            morphology.dilateR(mouseBSE.erodedBrain);
+            retcode |= ::CommonErrors::cantWrite(ap.adfFilename);
           }
-
         }
-        if (!ap.initBrainFilename.empty()) writeByte(ap.initBrainFilename,mouseBSE.erodedBrain);
-        if (mouseBSE.settings.verbosity>1) std::cout<<"dilating "<<ap.closingSize<<" : ";
-        for (int i=0;i<ap.closingSize;i++)
-        {
-          if (i&1) // alternate cube/diamond
-          {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'C';
-            morphology.dilateC(mouseBSE.erodedBrain);
-          }
-          else
-          {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'D';
-            morphology.dilateR(mouseBSE.erodedBrain);
-          }
-        }
-        if (mouseBSE.settings.verbosity>1) std::cout<<"\n";
-        RunLengthSegmenter rls;
-        rls.segmentBG(mouseBSE.erodedBrain);
-        if (mouseBSE.settings.verbosity>1) std::cout<<"eroding "<<ap.closingSize<<" : ";;
-        for (int i=0;i<ap.closingSize;i++)
-        {
-          if (i&1) // alternate cube/diamond
-          {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'C';
-            morphology.erodeC(mouseBSE.erodedBrain);
-          }
-          else
-          {
-            if (mouseBSE.settings.verbosity>1) std::cout<<'D';
-            morphology.erodeR(mouseBSE.erodedBrain);
-          }
-        }
-        if (mouseBSE.settings.verbosity>1) std::cout<<"\n";
-        if (mouseBSE.settings.dilateFinalMask>0)
+        if (mouseBSE.settings.verbosity>1) { std::cout<<"Performing edge detection"<<std::endl; }
+      }
+      if (ap.sweepSigmas.empty())
+      {
+        if (!streaming && !mouseBSE.edgeDetect(referenceVolume,mouseBSE.settings.edgeConstant)) return 1;
+        if (ap.edgeFilename.empty()==false) retcode |= writeEdgeMask(ap.edgeFilename,mouseBSE.edgemask,mouseBSE.settings.verbosity);
+        findBrainMask(maskVolume,mouseBSE,ap,referenceVolume,vCroppedMask,retcode,"");
+      }
+      else
+      {
+        // all of the edge maps are computed in one pass, then each is segmented in turn
+        std::vector<Vol3D<VBit>> edgeMasks(ap.sweepSigmas.size());
+        std::vector<Vol3D<VBit> *> edgeMaskPtrs;
+        for (auto &edgeMask : edgeMasks) edgeMaskPtrs.push_back(&edgeMask);
+        if (!mouseBSE.edgeDetect(edgeMaskPtrs,referenceVolume,ap.sweepSigmas)) return 1;
+        for (size_t i=0;i<edgeMasks.size();i++)
         {
-          if (mouseBSE.settings.verbosity>0) std::cout<<"dilating final mask ";
-          for (int i=0;i<mouseBSE.settings.erosionSize;i++)
-          {
-            if (i&1) // alternate cube/diamond
-            {
-              if (mouseBSE.settings.verbosity>1) std::cout<<'C';
-              morphology.dilateC(mouseBSE.erodedBrain);
-            }
-            else
-            {
-              if (mouseBSE.settings.verbosity>1) std::cout<<'D';
-              morphology.dilateR(mouseBSE.erodedBrain);
-            }
-          }
-          if (mouseBSE.settings.verbosity>0) std::cout<<"\n";
+          const std::string label = "_s" + ap.sweepLabels[i];
+          if (mouseBSE.settings.verbosity>0) std::cout<<"Edge sigma "<<ap.sweepLabels[i]<<std::endl;
+          copy(mouseBSE.edgemask,edgeMasks[i]);
+          if (ap.edgeFilename.empty()==false)
+            retcode |= writeEdgeMask(sweepFilename(ap.edgeFilename,label),mouseBSE.edgemask,mouseBSE.settings.verbosity);
+          findBrainMask(maskVolume,mouseBSE,ap,referenceVolume,vCroppedMask,retcode,label);
+          retcode |= writeMask(sweepFilename(ap.mfname,label),maskVolume,mouseBSE.settings.verbosity);
         }
-        mouseBSE.erodedBrain.decode(maskVolume);
       }
     }
   }
-  if (ap.mfname.empty()==false)
+  if (ap.mfname.empty()==false && ap.sweepSigmas.empty())
   {
-    std::ostringstream description;
-    maskVolume.description = description.str();
-    if (maskVolume.write(ap.mfname))
-    {
-      if (mouseBSE.settings.verbosity>0) std::cout<<"Wrote mask file "<<ap.mfname<<std::endl;
-    }
-    else
-      retcode |= ::CommonErrors::cantWrite(ap.mfname);
+    retcode |= writeMask(ap.mfname,maskVolume,mouseBSE.settings.verbosity);
   }
   if (ap.ofname.empty()==false)
   {
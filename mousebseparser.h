@@ -23,6 +23,8 @@
 
 #include <argparser.h>
 #include <limits.h>
+#include <sstream>
+#include <vector>
 
 class MouseBSETool;
 
@@ -37,6 +39,30 @@ public:
       errcode=2;
       return false;
     }
+    if (!sweep.empty())
+    {
+      std::istringstream list(sweep);
+      std::string label;
+      while (std::getline(list,label,','))
+      {
+        std::istringstream value(label);
+        float sigma=0;
+        if (!(value>>sigma) || sigma<=0)
+        {
+          std::cerr<<"error: invalid edge sigma "<<label<<" in --sweep list."<<std::endl;
+          errcode=2;
+          return false;
+        }
+        sweepSigmas.push_back(sigma);
+        sweepLabels.push_back(label);
+      }
+      if (mfname.empty() || !ofname.empty())
+      {
+        std::cerr<<"error: --sweep writes one --mask file per edge sigma and cannot be used with -o."<<std::endl;
+        errcode=2;
+        return false;
+      }
+    }
     return true;
 	}
 	int closingSize;
@@ -54,6 +80,11 @@ public:
   int yMin=0,yMax=INT_MAX;
   int zMin=0,zMax=INT_MAX;
   int zpad=0;
+  bool closingBall=false; // close with a Euclidean ball of radius closingSize
+  float closingMM=0; // closing radius in mm (0 uses closingSize)
+  std::string sweep;
+  std::vector<float> sweepSigmas; // edge sigmas parsed from sweep
+  std::vector<std::string> sweepLabels; // the same values as written in sweep, for the output filenames
 };
 
 #endif
@@ -22,103 +22,140 @@
 #include <DS/timer.h>
 #include <vol3d.h>
 #include <marrhildrethedgedetector.h>
+#include <separableconvolution.h>
 #include <volumescaler.h>
 #include <vol3dops.h>
 #include "anisotropicdiffusionfilter.h"
+#include <DS/slicequeue.h>
+#include <thread>
 
 MouseBSETool::Settings::Settings() :
-  diffusionIterations(3), diffusionConstant(25),
-  edgeConstant(0.64f), erosionSize(1), removeBrainstem(false),
+  diffusionIterations(3), diffusionConstant(25), diffusionBlocking(0), nativeDiffusion(false),
+  diffusionNoiseFloor(-1.0f), diffusionTolerance(-1.0f),
+  edgeConstant(0.64f), legacyEdgeFilter(false), recursiveEdgeFilter(false), halfEdgeStorage(false),
+  erosionSize(1), erosionRadiusMM(0), boxElements(false), removeBrainstem(false),
   dilateFinalMask(false), verbosity(1), selectRegion(-1)
 {
 }
 
-MouseBSETool::MouseBSETool(): bseState(ADFilter), saveCortex(false)
+MouseBSETool::MouseBSETool(): bseState(ADFilter), streamedInput(nullptr), saveCortex(false)
 {
 }
 
 
 template <class T>
-double regionMean(Vol3D<T> &vIn, Vol3D<uint8> &vMask)
+static void visitSlices(const Vol3D<T> &v, const MouseBSETool::SliceVisitor &visit)
 {
-  if (vIn.isCompatible(vMask)==false) return 0;
-  const int ds=vIn.size();
-  if (ds<=0) return 0;
-  double sum=0;
-  double den=0;
-  for (int i=0;i<ds;i++)
-    if (vMask[i]) { sum += vIn[i]; den++; }
-  return sum/den;
+  const size_t sliceSize = (size_t)v.cx*v.cy;
+  std::vector<float> slice(sliceSize);
+  for (int z=0;z<(int)v.cz;z++)
+  {
+    std::copy_n(v.start() + z*sliceSize,sliceSize,slice.data());
+    visit(slice.data(),z);
+  }
 }
 
-double regionMean(Vol3DBase *vIn, Vol3D<uint8> &vMask)
+bool MouseBSETool::visitFilteredSlices(const Vol3DBase *referenceVolume, const SliceVisitor &visit)
 {
-  switch (vIn->typeID())
-  {
-    case SILT::Uint8 : return regionMean(*static_cast< Vol3D<uint8> * >(vIn),vMask);
-    case SILT::Sint16 : return regionMean(*static_cast< Vol3D<sint16> * >(vIn),vMask);
-    case SILT::Uint16 : return regionMean(*static_cast< Vol3D<uint16> * >(vIn),vMask);
-    case SILT::Sint32 : return regionMean(*static_cast< Vol3D<sint32> * >(vIn),vMask);
-    case SILT::Uint32 : return regionMean(*static_cast< Vol3D<uint32> * >(vIn),vMask);
-    case SILT::Float32: return regionMean(*static_cast< Vol3D<float32> * >(vIn),vMask);
-    case SILT::Float64: return regionMean(*static_cast< Vol3D<float64> * >(vIn),vMask);
+  if (!referenceVolume) return streamedInput ? restream(streamedInput,visit) : false;
+  switch (referenceVolume->typeID())
+  {
+    case SILT::Uint8 : visitSlices(*static_cast< const Vol3D<uint8> * >(referenceVolume),visit); return true;
+    case SILT::Sint8 : visitSlices(*static_cast< const Vol3D<sint8> * >(referenceVolume),visit); return true;
+    case SILT::Sint16 : visitSlices(*static_cast< const Vol3D<sint16> * >(referenceVolume),visit); return true;
+    case SILT::Uint16 : visitSlices(*static_cast< const Vol3D<uint16> * >(referenceVolume),visit); return true;
+    case SILT::Float32: visitSlices(*static_cast< const Vol3D<float32> * >(referenceVolume),visit); return true;
     default: break;
   }
-  return 0;
+  return false;
 }
 
-bool MouseBSETool::concom(Vol3DBase *vIn, Vol3D<VBit> &vBitMask, int threshold)
+bool MouseBSETool::concom(const Vol3DBase *referenceVolume, Vol3D<VBit> &vBitMask, const Vol3D<uint8> &vCroppedMask, int threshold)
 {
   RunLengthSegmenter rls;
 //  Vol3D<VBit> vBitMask;
 //  vBitMask.encode(vMask);
   rls.segmentFG(vBitMask);
+  const int cx = vBitMask.cx;
+  const int cy = vBitMask.cy;
+  const int cz = vBitMask.cz;
+  // the regions in the table (at most 12); their means and the cropped region mean are gathered in
+  // one pass over the filtered volume, voxels are assigned to regions by their run labels
+  std::vector<int> regions;
+  for (int i=0;i<rls.nRegions() && i<=11;i++)
+    if (rls.regionCount(i)>threshold) regions.push_back(i);
+  std::vector<int> regionOf(rls.nRegions(),-1);
+  for (auto &region : rls.regionInfo) region.selected=0;
+  for (size_t r=0;r<regions.size();r++)
+  {
+    rls.regionInfo[regions[r]].selected = 1;
+    regionOf[rls.regionInfo[regions[r]].label] = (int)r;
+  }
+  if (!regions.empty()) rls.label32FG(vBitMask);
+  std::vector<double> sum(regions.size(),0), den(regions.size(),0);
+  double croppedSum = 0, croppedDen = 0;
+  const size_t wpl = VBit::wordsPerLine(cx);
+  const bool visited = visitFilteredSlices(referenceVolume,[&](const float *slice, const int z) {
+    const uint8 *cropped = vCroppedMask.start() + (size_t)z*cx*cy;
+    for (int i=0;i<cx*cy;i++)
+      if (cropped[i]) { croppedSum += slice[i]; croppedDen++; }
+    if (regions.empty()) return;
+    for (int y=0;y<cy;y++)
+    {
+      const VBit::Word *line = vBitMask.raw64() + ((size_t)z*cy + y)*wpl;
+      for (int x=0;x<cx;x++)
+        if ((line[x>>6]>>(x&63))&1)
+        {
+          const int r = regionOf[rls.labelID(x,y,z)];
+          sum[r] += slice[(size_t)y*cx + x];
+          den[r]++;
+        }
+    }
+  });
+  if (!visited) return false;
+  std::cout<<"cropped region mean is "<<croppedSum/croppedDen<<std::endl;
   Vol3D<uint8> vMask;
   Vol3D<VBit> vResult;
-  DSPoint center(vIn->cx/2.0f,vIn->cy/2.0f,vIn->cz/2.0f);
+  DSPoint center(cx/2.0f,cy/2.0f,cz/2.0f);
   std::cout<<"voxel center is "<<center.x<<','<<center.y<<','<<center.z<<std::endl;
   bool selected=false;
 
   std::cout<<"region table\n";
   std::cout<<"#\tvoxels\tcent_x\tcent_y\tcent_z\tmean\td_cent\n";
-  for (int i=0;i<rls.nRegions();i++)
+  for (size_t r=0;r<regions.size();r++)
   {
-    if (rls.regionCount(i)>threshold)
+    const int i = regions[r];
+    for (auto &region : rls.regionInfo) region.selected=0;
+    auto &currentRegion(rls.regionInfo[i]);
+    DSPoint centroid(currentRegion.cx,currentRegion.cy,currentRegion.cz);
+    std::cout<<i<<'\t'<<rls.regionCount(i)<<'\t'<<currentRegion.cx<<"\t"<<currentRegion.cy<<"\t"<<currentRegion.cz;
+    currentRegion.selected=1;
+    rls.label32FG(vBitMask);
+    auto mean=sum[r]/den[r];
+    auto dist=(centroid-center).mag();
+    std::cout<<'\t'<<mean<<'\t'<<dist;
+    if (mean==0) { std::cout<<" [rejected]\n"; continue; }
+    if (settings.selectRegion>0)
     {
-      for (auto &region : rls.regionInfo) region.selected=0;
-      auto &currentRegion(rls.regionInfo[i]);
-      DSPoint centroid(currentRegion.cx,currentRegion.cy,currentRegion.cz);
-      std::cout<<i<<'\t'<<rls.regionCount(i)<<'\t'<<currentRegion.cx<<"\t"<<currentRegion.cy<<"\t"<<currentRegion.cz;
-      currentRegion.selected=1;
-      rls.label32FG(vBitMask);
-      vBitMask.decode(vMask);
-      auto mean=regionMean(vIn,vMask);
-      auto dist=(centroid-center).mag();
-      std::cout<<'\t'<<mean<<'\t'<<dist;
-      if (mean==0) { std::cout<<" [rejected]\n"; continue; }
-      if (settings.selectRegion>0)
-      {
-        if (settings.selectRegion==i)
-        {
-          selected=true;
-          std::cout<<" [override]\n";
-          vResult.copy(vBitMask);
-          continue;
-        }
-      }
-      if (!selected)
+      if (settings.selectRegion==i)
       {
         selected=true;
-        std::cout<<" [selected]\n";
+        std::cout<<" [override]\n";
         vResult.copy(vBitMask);
         continue;
       }
+    }
+    if (!selected)
+    {
+      selected=true;
+      std::cout<<" [selected]\n";
+      vResult.copy(vBitMask);
+      continue;
+    }
 //      std::ostringstream ofname;
 //      ofname<<ap.ofname<<".r"<<i<<".mask.nii.gz";
 //      if (!vMask.write(ofname.str())) {return CommonErrors::cantWrite(ofname.str()); }
-      std::cout<<" [not selected]\n";
-    }
-    if (i>10) break;
+    std::cout<<" [not selected]\n";
   }
   if (selected) vBitMask.copy(vResult);
   return selected;
@@ -247,7 +284,7 @@ bool MouseBSETool::finishBrain(Vol3D<uint8> &maskVolume, const int erosionSize,
   {
     std::cout<<"dilating with operator size "<<erosionSize<<std::endl;
   }
-  for (int i=0;i<erosionSize;i++) morphology.dilateR(vBit);
+  morphology.dilate(vBit,std::string(std::max(erosionSize,0),'D'));
   if (settings.verbosity>2)
   {
     std::cout<<"closing"<<std::endl;
@@ -310,31 +347,38 @@ void MouseBSETool::stemTrim(Vol3D<uint8> &vmask, int nOpen, int nDilate)
 
 bool MouseBSETool::erodeBrain(Vol3D<uint8> &maskVolume, int erosionSize)
 {
-  erodedBrain.encode(maskVolume);
+  edgemask.encode(maskVolume);
+  return erodeBrain(erosionSize);
+}
+
+bool MouseBSETool::erodeBrain(int erosionSize)
+{
+  copy(erodedBrain,edgemask);
   morphology.setup(erodedBrain);
   if (settings.verbosity>1)
   {
     std::cout<<"eroding with operator size "<<erosionSize<<" : "<<std::flush;
   }
-  for (int i=0;i<erosionSize;i++)
-  {
-    if (i&1) // alternate cube/diamond
-    {
-      if (settings.verbosity>1) std::cout<<"C";
-      morphology.erodeC(erodedBrain);
-    }
-    else
-    {
-      if (settings.verbosity>1)
-      std::cout<<"D";
-      morphology.erodeR(erodedBrain);
-    }
-  }
+  applyErosionElement(morphology,erodedBrain,erosionSize,false);
   if (settings.verbosity>1)
     std::cout<<'\n';
   return true;
 }
 
+bool MouseBSETool::applyErosionElement(Morph32 &morph, Vol3D<VBit> &v, const int erosionSize, const bool dilate)
+{
+  if (settings.erosionRadiusMM>0)
+  {
+    const Morph32::Shape shape = settings.boxElements ? Morph32::Box : Morph32::Ellipsoid;
+    const float r = settings.erosionRadiusMM;
+    if (settings.verbosity>1) std::cout<<r<<"mm "<<(settings.boxElements ? "box" : "ellipsoid");
+    return dilate ? morph.dilateMM(v,shape,r,r,r) : morph.erodeMM(v,shape,r,r,r);
+  }
+  const std::string steps = Morph32::alternating(erosionSize); // alternate diamond/cube
+  if (settings.verbosity>1) std::cout<<steps;
+  return dilate ? morph.dilate(v,steps) : morph.erode(v,steps);
+}
+
 bool MouseBSETool::findBrain(Vol3D<uint8> &maskVolume, const Vol3DBase *volume)
 {
   if (settings.verbosity>1)
@@ -372,67 +416,235 @@ bool MouseBSETool::findBrain(Vol3D<uint8> &maskVolume, const Vol3DBase *volume)
 }
 
 bool MouseBSETool::edgeDetect(Vol3D<uint8> &maskVolume, const Vol3DBase *referenceVolume, const float edgeConstant)
+{
+  if (!edgeDetect(referenceVolume,edgeConstant)) return false;
+  edgemask.decode(maskVolume);
+  return true;
+}
+
+// the edge map is written directly to edgemask
+bool MouseBSETool::edgeDetect(const Vol3DBase *referenceVolume, const float edgeConstant)
 {
   switch (referenceVolume->typeID())
   {
-    case SILT::Uint8  : marrHildrethEdgeDetection(maskVolume,(Vol3D<uint8> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
-    case SILT::Sint8  : marrHildrethEdgeDetection(maskVolume,(Vol3D<sint8> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
-    case SILT::Uint16 : marrHildrethEdgeDetection(maskVolume,(Vol3D<uint16> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
-    case SILT::Sint16 : marrHildrethEdgeDetection(maskVolume,(Vol3D<sint16> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
+    case SILT::Uint8  : marrHildrethEdgeDetection(edgemask,(Vol3D<uint8> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
+    case SILT::Sint8  : marrHildrethEdgeDetection(edgemask,(Vol3D<sint8> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
+    case SILT::Uint16 : marrHildrethEdgeDetection(edgemask,(Vol3D<uint16> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
+    case SILT::Sint16 : marrHildrethEdgeDetection(edgemask,(Vol3D<sint16> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
+    case SILT::Float32: marrHildrethEdgeDetection(edgemask,(Vol3D<float32> *)referenceVolume,edgeConstant); bseState=ErodeBrain; break;
     default:
       errorMessage = "error: datatype ("+referenceVolume->datatypeName()+") is not currently supported for BSE.";
       std::cerr<<errorMessage<<std::endl;
       return false;
   }
-  edgemask.encode(maskVolume);
   return true;
 }
 
+bool MouseBSETool::edgeDetect(const std::vector<Vol3D<VBit> *> &edgeMasks, const Vol3DBase *referenceVolume, const std::vector<float> &edgeConstants)
+{
+  switch (referenceVolume->typeID())
+  {
+    case SILT::Uint8  : return marrHildrethEdgeDetection(edgeMasks,(Vol3D<uint8> *)referenceVolume,edgeConstants);
+    case SILT::Sint8  : return marrHildrethEdgeDetection(edgeMasks,(Vol3D<sint8> *)referenceVolume,edgeConstants);
+    case SILT::Uint16 : return marrHildrethEdgeDetection(edgeMasks,(Vol3D<uint16> *)referenceVolume,edgeConstants);
+    case SILT::Sint16 : return marrHildrethEdgeDetection(edgeMasks,(Vol3D<sint16> *)referenceVolume,edgeConstants);
+    case SILT::Float32: return marrHildrethEdgeDetection(edgeMasks,(Vol3D<float32> *)referenceVolume,edgeConstants);
+    default:
+      errorMessage = "error: datatype ("+referenceVolume->datatypeName()+") is not currently supported for BSE.";
+      std::cerr<<errorMessage<<std::endl;
+      return false;
+  }
+}
+
 template <class T>
-void MouseBSETool::marrHildrethEdgeDetection(Vol3D<uint8> &vMask, Vol3D<T> *vIn, const float sigma)
+void MouseBSETool::marrHildrethEdgeDetection(Vol3D<VBit> &vMask, Vol3D<T> *vIn, const float sigma)
 {
   MarrHildrethEdgeDetector<T> mh;
   mh.sigma = sigma;
+  mh.engine = settings.recursiveEdgeFilter ? MarrHildrethEdgeDetector<T>::Recursive
+            : settings.legacyEdgeFilter ? MarrHildrethEdgeDetector<T>::Legacy : MarrHildrethEdgeDetector<T>::Vector;
+  mh.halfStorage = settings.halfEdgeStorage;
+  if (settings.verbosity>1 && mh.engine==MarrHildrethEdgeDetector<T>::Vector)
+    std::cout<<"Edge detection using "<<SeparableConvolution::instructionSetName()<<" convolution"<<std::endl;
   mh.detect(*vIn,vMask);
 }
 
-bool MouseBSETool::initialize(Vol3DBase *& referenceVolume, const Vol3DBase *volume)
+template <class T>
+bool MouseBSETool::marrHildrethEdgeDetection(const std::vector<Vol3D<VBit> *> &vMasks, Vol3D<T> *vIn, const std::vector<float> &sigmas)
 {
+  MarrHildrethEdgeDetector<T> mh;
+  mh.engine = settings.recursiveEdgeFilter ? MarrHildrethEdgeDetector<T>::Recursive
+            : settings.legacyEdgeFilter ? MarrHildrethEdgeDetector<T>::Legacy : MarrHildrethEdgeDetector<T>::Vector;
+  if (settings.verbosity>1 && mh.engine==MarrHildrethEdgeDetector<T>::Vector)
+    std::cout<<"Edge detection using "<<SeparableConvolution::instructionSetName()<<" convolution"<<std::endl;
+  return mh.detect(*vIn,sigmas,vMasks);
+}
+
+// Returns the volume that the diffusion filter is applied to: volume itself if it is 8-bit or is
+// filtered natively, otherwise its 8-bit rescaling in vBuf. Returns nullptr for unsupported types.
+const Vol3DBase *MouseBSETool::diffusionInput(const Vol3DBase *volume)
+{
+  if (settings.nativeDiffusion)
+  {
+    switch (volume->typeID())
+    {
+      case SILT::Uint16 :
+      case SILT::Float32 : return volume;
+      default: break;
+    }
+  }
   switch (volume->typeID())
   {
     case SILT::Uint8 :
-    case SILT::Sint8 :  break;
-    case SILT::Uint16 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<uint16> *)volume); volume = &vBuf; break;
-    case SILT::Sint16 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<sint16> *)volume); volume = &vBuf; break;
-    case SILT::Float32 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<float32> *)volume); volume = &vBuf; break;
-    case SILT::Float64 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<float64> *)volume); volume = &vBuf; break;
+    case SILT::Sint8 :  return volume;
+    case SILT::Uint16 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<uint16> *)volume); return &vBuf;
+    case SILT::Sint16 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<sint16> *)volume); return &vBuf;
+    case SILT::Float32 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<float32> *)volume); return &vBuf;
+    case SILT::Float64 : VolumeScaler::scaleToUint8(vBuf,*(Vol3D<float64> *)volume); return &vBuf;
     default:
       errorMessage = "error: datatype ("+volume->datatypeName()+") is not currently supported for BSE.";
       std::cout<<errorMessage<<std::endl;
-      return false;
+      return nullptr;
   }
-  if (volume->typeID()!=SILT::Uint8 && volume->typeID()!=SILT::Sint8)
+}
+
+bool MouseBSETool::initialize(Vol3DBase *& referenceVolume, const Vol3DBase *volume)
+{
+  streamedInput = nullptr;
+  volume = diffusionInput(volume);
+  if (!volume) return false;
+  // the diffusion settings are given in units of the 8-bit rescaled image
+  switch (volume->typeID())
   {
-    errorMessage = "error: datatype ("+volume->datatypeName()+") is not currently supported for BSE.";
-    return false; // this is impossible, but serves as a reminder for later changes in the code
+    case SILT::Uint16 :
+      {
+        auto v = (Vol3D<uint16> *)volume;
+        adf(referenceVolume,v,settings.diffusionIterations,settings.diffusionConstant,settings.verbosity,(float)VolumeScaler::uint8Scale(*v));
+        break;
+      }
+    case SILT::Float32 :
+      {
+        auto v = (Vol3D<float32> *)volume;
+        adf(referenceVolume,v,settings.diffusionIterations,settings.diffusionConstant,settings.verbosity,(float)VolumeScaler::uint8Scale(*v));
+        break;
+      }
+    default:
+      adf(referenceVolume,(Vol3D<uint8> *)volume,settings.diffusionIterations,settings.diffusionConstant,settings.verbosity);
+      break;
   }
-  adf(referenceVolume,(Vol3D<uint8> *)volume,settings.diffusionIterations,settings.diffusionConstant,settings.verbosity);
   bseState=EdgeDetect;
   return true;
 }
 
-void MouseBSETool::adf(Vol3DBasePtr &ref, Vol3D<uint8> *vol, const int n, const float c, int verbosity)
+bool MouseBSETool::canStreamEdges() const
+{
+  return !settings.legacyEdgeFilter && !settings.recursiveEdgeFilter && !settings.halfEdgeStorage
+      && settings.diffusionNoiseFloor<0 && settings.diffusionTolerance<0;
+}
+
+// Calls fn(v,intensityScale) with the diffusion input volume cast to its type.
+template <class Fn>
+static bool withDiffusionInput(const Vol3DBase *volume, const Fn &fn)
+{
+  switch (volume->typeID())
+  {
+    case SILT::Uint16 :
+      {
+        auto v = (const Vol3D<uint16> *)volume;
+        return fn(*v,(float)VolumeScaler::uint8Scale(*v));
+      }
+    case SILT::Float32 :
+      {
+        auto v = (const Vol3D<float32> *)volume;
+        return fn(*v,(float)VolumeScaler::uint8Scale(*v));
+      }
+    default:
+      return fn(*(const Vol3D<uint8> *)volume,1.0f);
+  }
+}
+
+bool MouseBSETool::streamEdges(const Vol3DBase *volume)
+{
+  volume = diffusionInput(volume);
+  if (!volume) return false;
+  if (!withDiffusionInput(volume,[&](const auto &v, const float intensityScale) { return streamEdges(v,intensityScale); }))
+    return false;
+  streamedInput = volume;
+  bseState=ErodeBrain;
+  return true;
+}
+
+template <class T>
+bool MouseBSETool::streamEdges(const Vol3D<T> &volume, const float intensityScale)
+{
+  const int cx = volume.cx;
+  const int cy = volume.cy;
+  const int cz = volume.cz;
+  const size_t sliceSize = (size_t)cx*cy;
+  // the stages run on separate pools; the diffusion filter does most of the work
+  const int nThreads = ThreadPool::global().size();
+  const int nEdgeThreads = std::max(1,nThreads/3);
+  ThreadPool diffusionPool(std::max(1,nThreads-nEdgeThreads));
+  ThreadPool edgePool(nEdgeThreads);
+  AnisotropicDiffusionFilter f(settings.diffusionIterations,settings.diffusionConstant/intensityScale);
+  f.threadPool = &diffusionPool;
+  MarrHildrethEdgeDetector<T> mh;
+  mh.threadPool = &edgePool;
+  if (!edgemask.makeCompatible(volume)) return false;
+  SliceQueue<T> queue(sliceSize,streamQueueSlices);
+  bool filtered = false;
+  std::thread producer([&]() {
+    filtered = f.filterStream<T>(cx,cy,cz,
+      [&](T *slice, const int z) {
+        std::copy_n(volume.start() + (size_t)z * sliceSize,sliceSize,slice);
+        return true;
+      },
+      [&](const T *slice, const int) { return queue.push(slice); },settings.verbosity);
+    queue.close();
+  });
+  const bool detected = mh.detectStream(cx,cy,cz,[&](T *slice, const int) { return queue.pop(slice); },
+                                        {settings.edgeConstant},{&edgemask});
+  queue.close();
+  producer.join();
+  return filtered && detected;
+}
+
+bool MouseBSETool::restream(const Vol3DBase *volume, const SliceVisitor &visit)
+{
+  return withDiffusionInput(volume,[&](const auto &v, const float intensityScale) { return restream(v,intensityScale,visit); });
+}
+
+template <class T>
+bool MouseBSETool::restream(const Vol3D<T> &volume, const float intensityScale, const SliceVisitor &visit)
+{
+  const size_t sliceSize = (size_t)volume.cx*volume.cy;
+  AnisotropicDiffusionFilter f(settings.diffusionIterations,settings.diffusionConstant/intensityScale);
+  std::vector<float> buffer(sliceSize);
+  return f.filterStream<T>(volume.cx,volume.cy,volume.cz,
+    [&](T *slice, const int z) {
+      std::copy_n(volume.start() + (size_t)z * sliceSize,sliceSize,slice);
+      return true;
+    },
+    [&](const T *slice, const int z) {
+      std::copy_n(slice,sliceSize,buffer.data());
+      visit(buffer.data(),z);
+      return true;
+    },0);
+}
+
+template <class T>
+void MouseBSETool::adf(Vol3DBasePtr &ref, Vol3D<T> *vol, const int n, const float c, int verbosity, const float intensityScale)
 {
 
-  Vol3D<uint8> *result=0;
+  Vol3D<T> *result=0;
   if (ref)
   {
-    if (ref->typeID()==vol->typeID()) result = (Vol3D<uint8> *)ref;
+    if (ref->typeID()==vol->typeID()) result = (Vol3D<T> *)ref;
     else { delete ref; ref = 0; }
   }
   if (!result)
   {
-    result = new Vol3D<uint8>;
+    result = new Vol3D<T>;
     if (verbosity>1) std::cout<<"made new reference volume"<<std::endl;
   }
   if (n==0)
@@ -441,8 +653,13 @@ void MouseBSETool::adf(Vol3DBasePtr &ref, Vol3D<uint8> *vol, const int n, const
   }
   else
   {
-    AnisotropicDiffusionFilter f(n,c);
+    AnisotropicDiffusionFilter f(n,c/intensityScale);
+    f.blockIterations = settings.diffusionBlocking;
+    if (settings.diffusionNoiseFloor>=0) f.noiseFloor = settings.diffusionNoiseFloor/intensityScale;
+    if (settings.diffusionTolerance>=0) f.tolerance = settings.diffusionTolerance/intensityScale;
     f.filter(*result,*vol,verbosity);
+    if (verbosity>0 && f.tolerance>=0)
+      std::cout<<"anisotropic diffusion filter ran "<<f.iterationsRun<<" of "<<n<<" iterations"<<std::endl;
   }
   ref = result;
 }
@@ -25,6 +25,7 @@
 #include <DS/runlengthsegmenter.h>
 #include <DS/morph32.h>
 #include <iostream>
+#include <functional>
 
 class MouseBSETool {
 public:
@@ -35,8 +36,17 @@ public:
     Settings();
     int diffusionIterations;
     float diffusionConstant;
+    int diffusionBlocking;
+    bool nativeDiffusion; // filter uint16 and float32 volumes without converting them to uint8
+    float diffusionNoiseFloor; // skip diffusion far from voxels above this value (<0 filters everything)
+    float diffusionTolerance; // stop diffusion once the mean absolute update is at or below this value (<0 runs all iterations)
     float edgeConstant;
+    bool legacyEdgeFilter; // use the original double-precision Marr-Hildreth filter
+    bool recursiveEdgeFilter; // use recursive Gaussian filters, whose cost does not depend on edgeConstant
+    bool halfEdgeStorage; // keep the edge filter's intermediate slices as 16-bit floats
     int erosionSize;
+    float erosionRadiusMM; // radius in mm of the erosion/dilation element, used instead of erosionSize when >0
+    bool boxElements; // use boxes rather than ellipsoids for the elements given in mm
     bool removeBrainstem;
     int dilateFinalMask;
     int verbosity;
@@ -55,20 +65,54 @@ public:
   bool stepBack(Vol3D<uint8> &maskVolume, Vol3DBase *&, const Vol3DBase *); // go back one step, return false if at beginning
   bool goForward(Vol3D<uint8> &maskVolume, Vol3DBase *&referenceVolume, const Vol3DBase *volume); // run next step, return false if at end
   bool reset(); // reset to the beginning, clear stored data
-  bool concom(Vol3DBase *vIn, Vol3D<VBit> &vBitMask, int threshold=100000);
+  // Selects the region of vBitMask used as the initial brain, printing the mean of the filtered
+  // volume over vCroppedMask and the region table.
+  bool concom(const Vol3DBase *referenceVolume, Vol3D<VBit> &vBitMask, const Vol3D<uint8> &vCroppedMask,
+              int threshold=100000);
+  typedef std::function<void(const float *slice, const int z)> SliceVisitor;
+  // Calls visit for each slice of the filtered volume in order. It is referenceVolume if that
+  // was stored; otherwise the filter is run again on the input given to streamEdges.
+  bool visitFilteredSlices(const Vol3DBase *referenceVolume, const SliceVisitor &visit);
 
   std::string nextStepName();
 // the individual steps
-  void adf(Vol3DBasePtr &referenceVolume, Vol3D<uint8> *volume, const int nIterations, const float diffusionConstant, int verbosity=1);
+  // intensityScale maps the intensities of volume to the 8-bit range used by the settings
+  template <class T>
+  void adf(Vol3DBasePtr &referenceVolume, Vol3D<T> *volume, const int nIterations, const float diffusionConstant, int verbosity=1,
+           const float intensityScale=1.0f);
   bool initialize(Vol3DBase *& referenceVolume, const Vol3DBase *volume);
+  const Vol3DBase *diffusionInput(const Vol3DBase *volume);
+  // Runs the diffusion filter and the edge detector as one streaming stage on separate threads,
+  // passing the filtered slices through a queue of streamQueueSlices slices, so the filtered
+  // volume is never stored. Fills edgemask; the region statistics run the filter again (see
+  // visitFilteredSlices).
+  bool streamEdges(const Vol3DBase *volume);
+  template <class T> bool streamEdges(const Vol3D<T> &volume, const float intensityScale);
+  // streaming supports the float Vector edge filter and diffusion without a noise floor or tolerance
+  bool canStreamEdges() const;
+  static const int streamQueueSlices = 32;
+  bool restream(const Vol3DBase *volume, const SliceVisitor &visit);
+  template <class T> bool restream(const Vol3D<T> &volume, const float intensityScale, const SliceVisitor &visit);
+  const Vol3DBase *streamedInput; // the diffusion input of the last streamEdges
+  // the step interface leaves the edge map in maskVolume and erodes the map it finds there; the
+  // overloads without maskVolume work on edgemask directly
   bool edgeDetect(Vol3D<uint8> &maskVolume, const Vol3DBase *referenceVolume, const float edgeConstant);
+  bool edgeDetect(const Vol3DBase *referenceVolume, const float edgeConstant);
+  // detects the edges for each of edgeConstants in one pass, writing one map per value to edgeMasks
+  bool edgeDetect(const std::vector<Vol3D<VBit> *> &edgeMasks, const Vol3DBase *referenceVolume, const std::vector<float> &edgeConstants);
   bool erodeBrain(Vol3D<uint8> &maskVolume, int erosionSize);
+  bool erodeBrain(int erosionSize);
+  // dilates or erodes v by the element of radius erosionRadiusMM if it is set, otherwise by
+  // erosionSize alternating diamond/cube steps
+  bool applyErosionElement(Morph32 &morph, Vol3D<VBit> &v, const int erosionSize, const bool dilate);
   bool findBrain(Vol3D<uint8> &maskVolume, const Vol3DBase *volume);
   bool finishBrain(Vol3D<uint8> &maskVolume, const int erosionSize, bool removeBrainstem=false);
   // this trims brainstem / spinal cord
   void stemTrim(Vol3D<uint8> &vmask, int nOpen=2, int nDilate=4);
   template <class T>
-  void marrHildrethEdgeDetection(Vol3D<uint8> &vMask, Vol3D<T> *vIn, const float sigma);
+  void marrHildrethEdgeDetection(Vol3D<VBit> &vMask, Vol3D<T> *vIn, const float sigma);
+  template <class T>
+  bool marrHildrethEdgeDetection(const std::vector<Vol3D<VBit> *> &vMasks, Vol3D<T> *vIn, const std::vector<float> &sigmas);
   bool saveCortex;
   Vol3D<VBit> edgemask, erodedBrain, initBrain, vCortex;
   Vol3D<uint8> vBuf;
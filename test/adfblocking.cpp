@@ -0,0 +1,86 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks that fusing iterations into one pass (blockIterations=2..7) gives byte-identical output
+// to one pass per iteration (blockIterations=1), on odd volume sizes including cz=1,2,3, with
+// and without a noise floor, and with pools of 1 and 4 threads.
+
+#include "anisotropicdiffusionfilter.h"
+#include <random>
+#include <iostream>
+#include <cstring>
+
+template <class T>
+static int countDifferences(std::mt19937 &rng, const int cx, const int cy, const int cz, const float maxValue,
+                            ThreadPool &threadPool)
+{
+  const int nIterations = 7;
+  Vol3D<T> vIn;
+  vIn.setsize(cx,cy,cz);
+  std::uniform_real_distribution<float> value(0,maxValue);
+  for (size_t i=0;i<vIn.size();i++) vIn[i] = (T)((i/7)%3 ? value(rng) : 0);
+  int nDiffer = 0;
+  for (float noiseFloor : {-1.0f,0.3f*maxValue})
+  {
+    AnisotropicDiffusionFilter filter(nIterations,25.0f,0.125f);
+    filter.threadPool = &threadPool;
+    filter.noiseFloor = noiseFloor;
+    filter.blockIterations = 1;
+    Vol3D<T> reference;
+    if (!filter.filter(reference,vIn,0)) return -1;
+    for (int blockIterations=2;blockIterations<=nIterations;blockIterations++)
+    {
+      filter.blockIterations = blockIterations;
+      Vol3D<T> vOut;
+      if (!filter.filter(vOut,vIn,0)) return -1;
+      if (memcmp(reference.start(),vOut.start(),reference.size()*sizeof(T)))
+      {
+        nDiffer++;
+        std::cout<<"blockIterations="<<blockIterations<<" differs for "<<cx<<"x"<<cy<<"x"<<cz<<" ("<<sizeof(T)
+                 <<"-byte voxels, noiseFloor "<<noiseFloor<<", "<<threadPool.size()<<" threads)"<<std::endl;
+      }
+    }
+  }
+  return nDiffer;
+}
+
+int main()
+{
+  std::mt19937 rng(3);
+  ThreadPool pool1(1), pool4(4);
+  const int dims[][3] = { {17,13,1}, {9,11,2}, {31,7,3}, {5,5,5}, {33,31,11}, {65,23,17}, {101,9,29} };
+  int nCases = 0, nDiffer = 0;
+  for (ThreadPool *threadPool : {&pool1,&pool4})
+    for (auto &d : dims)
+    {
+      const int n8 = countDifferences<uint8>(rng,d[0],d[1],d[2],255,*threadPool);
+      const int n16 = countDifferences<uint16>(rng,d[0],d[1],d[2],4095,*threadPool);
+      const int nf = countDifferences<float32>(rng,d[0],d[1],d[2],255,*threadPool);
+      if (n8<0 || n16<0 || nf<0)
+      {
+        std::cout<<"filter failed for "<<d[0]<<"x"<<d[1]<<"x"<<d[2]<<std::endl;
+        return 1;
+      }
+      nDiffer += n8 + n16 + nf;
+      nCases += 3*2*6;
+    }
+  std::cout<<nDiffer<<" of "<<nCases<<" fused runs differ from one pass per iteration"<<std::endl;
+  return nDiffer ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks that the diffusion filter gives bit-identical output for any number of threads: filter
+// (fused, sparse and adaptive modes) and filterStream are run on random uint8, uint16 and float
+// volumes with pools of 1, 3 and 8 threads.
+
+#include "anisotropicdiffusionfilter.h"
+#include <random>
+#include <iostream>
+#include <cstring>
+
+enum Mode { Fused=0, Sparse=1, Adaptive=2, Stream=3 };
+static const char *modeNames[] = { "filter", "noiseFloor", "tolerance", "filterStream" };
+
+template <class T>
+static bool filter(Vol3D<T> &vOut, const Vol3D<T> &vIn, const Mode mode, ThreadPool &threadPool)
+{
+  AnisotropicDiffusionFilter f(4,25.0f,0.125f);
+  f.threadPool = &threadPool;
+  if (mode==Sparse) f.noiseFloor = 40;
+  if (mode==Adaptive) f.tolerance = 0.5f;
+  if (mode!=Stream) return f.filter(vOut,vIn,0);
+  if (!vOut.makeCompatible(vIn)) return false;
+  const size_t sliceSize = (size_t)vIn.cx*vIn.cy;
+  return f.filterStream<T>(vIn.cx,vIn.cy,vIn.cz,
+    [&](T *slice, const int z) { std::copy_n(vIn.start() + z*sliceSize,sliceSize,slice); return true; },
+    [&](const T *slice, const int z) { std::copy_n(slice,sliceSize,vOut.start() + z*sliceSize); return true; },0);
+}
+
+template <class T>
+static int countDifferences(std::mt19937 &rng, const int cx, const int cy, const int cz, const float maxValue,
+                            ThreadPool *threadPools[], const int nPools)
+{
+  Vol3D<T> vIn;
+  vIn.setsize(cx,cy,cz);
+  std::uniform_real_distribution<float> value(0,maxValue);
+  for (size_t i=0;i<vIn.size();i++) vIn[i] = (T)((i/5)%4 ? value(rng) : 0);
+  int nDiffer = 0;
+  for (int mode=Fused;mode<=Stream;mode++)
+  {
+    Vol3D<T> reference;
+    if (!filter(reference,vIn,(Mode)mode,*threadPools[0])) return -1;
+    for (int p=1;p<nPools;p++)
+    {
+      Vol3D<T> vOut;
+      if (!filter(vOut,vIn,(Mode)mode,*threadPools[p])) return -1;
+      if (memcmp(reference.start(),vOut.start(),reference.size()*sizeof(T)))
+      {
+        nDiffer++;
+        std::cout<<modeNames[mode]<<" with "<<threadPools[p]->size()<<" threads differs for "<<cx<<"x"<<cy<<"x"<<cz
+                 <<" ("<<sizeof(T)<<"-byte voxels)"<<std::endl;
+      }
+    }
+  }
+  return nDiffer;
+}
+
+int main()
+{
+  std::mt19937 rng(2);
+  ThreadPool pool1(1), pool3(3), pool8(8);
+  ThreadPool *threadPools[] = { &pool1, &pool3, &pool8 };
+  const int dims[][3] = { {16,16,1}, {17,13,2}, {9,11,3}, {33,31,11}, {64,50,40}, {101,7,29}, {80,64,24} };
+  int nCases = 0, nDiffer = 0;
+  for (auto &d : dims)
+  {
+    const int n8 = countDifferences<uint8>(rng,d[0],d[1],d[2],255,threadPools,3);
+    const int n16 = countDifferences<uint16>(rng,d[0],d[1],d[2],4095,threadPools,3);
+    const int nf = countDifferences<float32>(rng,d[0],d[1],d[2],255,threadPools,3);
+    if (n8<0 || n16<0 || nf<0)
+    {
+      std::cout<<"filter failed for "<<d[0]<<"x"<<d[1]<<"x"<<d[2]<<std::endl;
+      return 1;
+    }
+    nDiffer += n8 + n16 + nf;
+    nCases += 3*4*2;
+  }
+  std::cout<<nDiffer<<" of "<<nCases<<" multithreaded runs differ from one thread"<<std::endl;
+  return nDiffer ? 1 : 0;
+}
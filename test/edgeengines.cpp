@@ -0,0 +1,63 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks that the edge maps of the Vector engine of MarrHildrethEdgeDetector agree with the
+// Legacy engine (mousebse --edgelegacy) on random volumes. The engines round differently, so
+// they may disagree where the Laplacian is within rounding error of zero; the check fails if
+// more than 0.1% of the voxels differ.
+// Also checks the Vector engine with halfStorage against its float buffers; it fails if more
+// than 0.5% of the float map's edge voxels differ.
+
+#include <marrhildrethedgedetector.h>
+#include <random>
+#include <iostream>
+
+int main()
+{
+  std::mt19937 rng(5);
+  const int dims[][3] = { {20,20,1}, {20,20,5}, {24,22,12}, {30,31,29}, {64,50,40}, {65,20,9}, {97,10,12} };
+  size_t nDiffer = 0, nVoxels = 0, nEdges = 0, nHalfDiffer = 0, nVectorEdges = 0;
+  for (auto &d : dims)
+    for (float sigma : {0.64f,1.0f,1.5f,2.5f})
+    {
+      Vol3D<uint8> vIn;
+      vIn.setsize(d[0],d[1],d[2]);
+      for (size_t i=0;i<vIn.size();i++) vIn[i] = (uint8)(rng()%256 * ((i/7)%3!=0));
+      MarrHildrethEdgeDetector<uint8> legacy, vector, half;
+      legacy.sigma = vector.sigma = half.sigma = sigma;
+      legacy.engine = MarrHildrethEdgeDetector<uint8>::Legacy;
+      vector.engine = half.engine = MarrHildrethEdgeDetector<uint8>::Vector;
+      half.halfStorage = true;
+      Vol3D<uint8> a, b, c;
+      if (!legacy.detect(vIn,a) || !vector.detect(vIn,b) || !half.detect(vIn,c)) return 1;
+      for (size_t i=0;i<a.size();i++)
+      {
+        nDiffer += a[i]!=b[i];
+        nEdges += a[i]==0;
+        nHalfDiffer += b[i]!=c[i];
+        nVectorEdges += b[i]==0;
+      }
+      nVoxels += a.size();
+    }
+  std::cout<<nDiffer<<" of "<<nVoxels<<" voxels differ ("<<nEdges<<" edge voxels)"<<std::endl;
+  std::cout<<"halfStorage: "<<nHalfDiffer<<" voxels differ, "<<100.0*nHalfDiffer/std::max<size_t>(nVectorEdges,1)
+           <<"% of "<<nVectorEdges<<" edge voxels (limit 0.5%)"<<std::endl;
+  return (nDiffer*1000>nVoxels || nHalfDiffer*200>nVectorEdges) ? 1 : 0;
+}
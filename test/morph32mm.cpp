@@ -0,0 +1,119 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks Morph32::dilateMM and Morph32::erodeMM with a box element on anisotropic volumes with
+// different radii along x, y and z: against a brute-force box, and a box of h voxels along each
+// axis against h cube steps ("CC...C").
+
+#include <vol3d.h>
+#include <vbit.h>
+#include <DS/morph32.h>
+#include <random>
+#include <iostream>
+#include <cstring>
+
+// Dilation or erosion of mask by the box with half-widths hx, hy, hz; voxels outside the volume
+// are background.
+static void bruteForceBox(Vol3D<uint8> &out, const Vol3D<uint8> &mask, const int hx, const int hy, const int hz,
+                          const bool dilate)
+{
+  const int cx = mask.cx, cy = mask.cy, cz = mask.cz;
+  out.makeCompatible(mask);
+  for (int z=0;z<cz;z++)
+    for (int y=0;y<cy;y++)
+      for (int x=0;x<cx;x++)
+      {
+        bool hit = false; // a foreground voxel (dilation) or a background voxel (erosion) in the box
+        for (int w=z-hz;w<=z+hz && !hit;w++)
+          for (int v=y-hy;v<=y+hy && !hit;v++)
+            for (int u=x-hx;u<=x+hx && !hit;u++)
+            {
+              const bool inside = u>=0 && u<cx && v>=0 && v<cy && w>=0 && w<cz;
+              const bool set = inside && mask(u,v,w);
+              hit = dilate ? set : !set;
+            }
+        out(x,y,z) = (hit==dilate) ? 255 : 0;
+      }
+}
+
+static bool differs(Vol3D<VBit> &a, Vol3D<VBit> &b)
+{
+  Vol3D<uint8> a8, b8;
+  a.decode(a8);
+  b.decode(b8);
+  return memcmp(a8.start(),b8.start(),a8.size())!=0;
+}
+
+int main()
+{
+  std::mt19937 rng(13);
+  const float voxelSizes[] = { 0.05f, 0.1f, 0.25f, 0.5f, 1.0f, 2.0f };
+  int nBoxCases = 0, nBoxDiffer = 0, nStepCases = 0, nStepDiffer = 0;
+  for (int t=0;t<200;t++)
+  {
+    const int cx = 1+rng()%140, cy = 1+rng()%30, cz = 1+rng()%30;
+    Vol3D<uint8> mask;
+    mask.setsize(cx,cy,cz);
+    mask.rx = voxelSizes[rng()%6];
+    mask.ry = voxelSizes[rng()%6];
+    mask.rz = voxelSizes[rng()%6];
+    std::bernoulli_distribution density(0.02+0.3*(rng()%3));
+    for (size_t i=0;i<mask.size();i++) mask[i] = density(rng) ? 255 : 0;
+    const bool dilate = rng()&1;
+    Morph32 morph;
+    ThreadPool threadPool(1+rng()%4);
+    morph.threadPool = &threadPool;
+    const int hx = rng()%5, hy = rng()%4, hz = rng()%4;
+    Vol3D<uint8> reference;
+    bruteForceBox(reference,mask,hx,hy,hz,dilate);
+    Vol3D<VBit> box, expected;
+    box.encode(mask);
+    expected.encode(reference);
+    // radii halfway between voxel multiples, so that the half-widths do not depend on rounding
+    const float radiusX = (hx+0.5f)*mask.rx, radiusY = (hy+0.5f)*mask.ry, radiusZ = (hz+0.5f)*mask.rz;
+    if (!(dilate ? morph.dilateMM(box,Morph32::Box,radiusX,radiusY,radiusZ)
+                 : morph.erodeMM(box,Morph32::Box,radiusX,radiusY,radiusZ))) return 1;
+    nBoxCases++;
+    if (differs(box,expected))
+    {
+      nBoxDiffer++;
+      std::cout<<(dilate ? "dilateMM " : "erodeMM ")<<radiusX<<"x"<<radiusY<<"x"<<radiusZ<<"mm box differs from brute force for "
+               <<cx<<"x"<<cy<<"x"<<cz<<" ("<<mask.rx<<"x"<<mask.ry<<"x"<<mask.rz<<"mm voxels)"<<std::endl;
+    }
+    const int h = 1+rng()%6;
+    Vol3D<VBit> mm, steps;
+    mm.encode(mask);
+    steps.encode(mask);
+    if (!(dilate ? morph.dilateMM(mm,Morph32::Box,h*mask.rx,h*mask.ry,h*mask.rz)
+                 : morph.erodeMM(mm,Morph32::Box,h*mask.rx,h*mask.ry,h*mask.rz))) return 1;
+    const std::string cubes(h,'C');
+    dilate ? morph.dilate(steps,cubes) : morph.erode(steps,cubes);
+    nStepCases++;
+    if (differs(mm,steps))
+    {
+      nStepDiffer++;
+      std::cout<<(dilate ? "dilateMM " : "erodeMM ")<<h<<"-voxel box differs from "<<cubes<<" for "
+               <<cx<<"x"<<cy<<"x"<<cz<<" ("<<mask.rx<<"x"<<mask.ry<<"x"<<mask.rz<<"mm voxels)"<<std::endl;
+    }
+  }
+  std::cout<<nBoxDiffer<<" of "<<nBoxCases<<" boxes differ from brute force, "
+           <<nStepDiffer<<" of "<<nStepCases<<" differ from cube steps"<<std::endl;
+  return (nBoxDiffer || nStepDiffer) ? 1 : 0;
+}
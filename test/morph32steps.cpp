@@ -0,0 +1,167 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks that the fused Morph32::dilate and Morph32::erode produce the same masks as applying
+// dilateR/dilateC and erodeR/erodeC one step at a time, for random masks, step sequences, thread
+// counts and cache sizes. Also checks the distance-based operators: dilateOctagon/erodeOctagon
+// against the fused alternating steps, and dilateBall/erodeBall against a brute-force ball.
+
+#include <vol3d.h>
+#include <vbit.h>
+#include <DS/morph32.h>
+#include <random>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+static void randomMask(std::mt19937 &rng, Vol3D<uint8> &mask, const int cx, const int cy, const int cz)
+{
+  mask.setsize(cx,cy,cz);
+  std::bernoulli_distribution density(0.05+0.3*(rng()%3));
+  for (size_t i=0;i<mask.size();i++) mask[i] = density(rng) ? 255 : 0;
+}
+
+// Dilation or erosion of mask by the voxels within squared distance r2; voxels outside the volume
+// are background.
+static void bruteForceBall(Vol3D<uint8> &out, const Vol3D<uint8> &mask, const int r2, const bool dilate)
+{
+  const int cx = mask.cx, cy = mask.cy, cz = mask.cz;
+  int r = 0;
+  while ((r+1)*(r+1)<=r2) r++;
+  out.makeCompatible(mask);
+  for (int z=0;z<cz;z++)
+    for (int y=0;y<cy;y++)
+      for (int x=0;x<cx;x++)
+      {
+        bool hit = false; // a foreground voxel (dilation) or a background voxel (erosion) in the ball
+        for (int dz=-r;dz<=r && !hit;dz++)
+          for (int dy=-r;dy<=r && !hit;dy++)
+            for (int dx=-r;dx<=r && !hit;dx++)
+            {
+              if (dx*dx+dy*dy+dz*dz>r2) continue;
+              const int u = x+dx, v = y+dy, w = z+dz;
+              const bool inside = u>=0 && u<cx && v>=0 && v<cy && w>=0 && w<cz;
+              const bool set = inside && mask(u,v,w);
+              hit = dilate ? set : !set;
+            }
+        out(x,y,z) = (hit==dilate) ? 255 : 0;
+      }
+}
+
+static bool differs(Vol3D<VBit> &a, Vol3D<VBit> &b)
+{
+  Vol3D<uint8> a8, b8;
+  a.decode(a8);
+  b.decode(b8);
+  return memcmp(a8.start(),b8.start(),a8.size())!=0;
+}
+
+int main()
+{
+  std::mt19937 rng(11);
+  int nCases = 0, nDiffer = 0;
+  for (int t=0;t<300;t++)
+  {
+    const int cx = 1+rng()%150, cy = 1+rng()%20, cz = 1+rng()%70;
+    Vol3D<uint8> mask;
+    mask.setsize(cx,cy,cz);
+    std::bernoulli_distribution density(0.2+0.3*(rng()%3));
+    for (size_t i=0;i<mask.size();i++) mask[i] = density(rng) ? 255 : 0;
+    std::string steps;
+    const int nSteps = rng()%12;
+    for (int i=0;i<nSteps;i++) steps += (rng()&1) ? 'C' : 'D';
+    const bool dilate = rng()&1;
+    ThreadPool threadPool(1+rng()%5);
+    Vol3D<VBit> stepwise, fused;
+    stepwise.encode(mask);
+    fused.encode(mask);
+    Morph32 a, b;
+    a.threadPool = b.threadPool = &threadPool;
+    b.cacheBytes = (rng()&1) ? rng()%200000 : Morph32::defaultCacheBytes;
+    for (char c : steps)
+    {
+      if (c=='D') dilate ? a.dilateR(stepwise) : a.erodeR(stepwise);
+      else dilate ? a.dilateC(stepwise) : a.erodeC(stepwise);
+    }
+    dilate ? b.dilate(fused,steps) : b.erode(fused,steps);
+    Vol3D<uint8> a8, b8;
+    stepwise.decode(a8);
+    fused.decode(b8);
+    nCases++;
+    if (memcmp(a8.start(),b8.start(),a8.size()))
+    {
+      nDiffer++;
+      std::cout<<(dilate ? "dilate " : "erode ")<<steps<<" differs for "<<cx<<"x"<<cy<<"x"<<cz<<std::endl;
+    }
+  }
+  std::cout<<nDiffer<<" of "<<nCases<<" fused operations differ"<<std::endl;
+  int nOctagonCases = 0, nOctagonDiffer = 0;
+  for (int t=0;t<120;t++)
+  {
+    const int cx = 1+rng()%90, cy = 1+rng()%30, cz = 1+rng()%40;
+    Vol3D<uint8> mask;
+    randomMask(rng,mask,cx,cy,cz);
+    const int nSteps = 1+rng()%9;
+    const bool dilate = rng()&1;
+    Vol3D<VBit> steps, octagon;
+    steps.encode(mask);
+    octagon.encode(mask);
+    Morph32 morph;
+    ThreadPool threadPool(1+rng()%4);
+    morph.threadPool = &threadPool;
+    const std::string sequence = Morph32::alternating(nSteps);
+    dilate ? morph.dilate(steps,sequence) : morph.erode(steps,sequence);
+    dilate ? morph.dilateOctagon(octagon,nSteps) : morph.erodeOctagon(octagon,nSteps);
+    nOctagonCases++;
+    if (differs(steps,octagon))
+    {
+      nOctagonDiffer++;
+      std::cout<<(dilate ? "dilateOctagon " : "erodeOctagon ")<<nSteps<<" differs from "<<sequence<<" for "
+               <<cx<<"x"<<cy<<"x"<<cz<<std::endl;
+    }
+  }
+  std::cout<<nOctagonDiffer<<" of "<<nOctagonCases<<" octagon operations differ from the alternating steps"<<std::endl;
+  int nBallCases = 0, nBallDiffer = 0;
+  for (int t=0;t<80;t++)
+  {
+    const int cx = 1+rng()%40, cy = 1+rng()%25, cz = 1+rng()%25;
+    Vol3D<uint8> mask, reference;
+    randomMask(rng,mask,cx,cy,cz);
+    const float radius = 1.0f + (rng()%40)/10.0f;
+    const bool dilate = rng()&1;
+    Vol3D<VBit> ball, expected;
+    ball.encode(mask);
+    Morph32 morph;
+    ThreadPool threadPool(1+rng()%4);
+    morph.threadPool = &threadPool;
+    dilate ? morph.dilateBall(ball,radius) : morph.erodeBall(ball,radius);
+    bruteForceBall(reference,mask,(int)std::floor(radius*radius),dilate);
+    expected.encode(reference);
+    nBallCases++;
+    if (differs(ball,expected))
+    {
+      nBallDiffer++;
+      std::cout<<(dilate ? "dilateBall " : "erodeBall ")<<radius<<" differs from brute force for "
+               <<cx<<"x"<<cy<<"x"<<cz<<std::endl;
+    }
+  }
+  std::cout<<nBallDiffer<<" of "<<nBallCases<<" ball operations differ from brute force"<<std::endl;
+  return (nDiffer || nOctagonDiffer || nBallDiffer) ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks RunLengthSegmenter on random masks: segmentFG must keep the largest 6-connected
+// component found by a flood fill, and segmentBG must give the same result with union-find and
+// graph labeling for any number of threads. The masks are wider than one 64-bit word, so runs
+// that cross word boundaries are covered.
+
+#include <vol3d.h>
+#include <vbit.h>
+#include <DS/runlengthsegmenter.h>
+#include <random>
+#include <iostream>
+#include <cstring>
+
+// size of the largest 6-connected component of mask, and whether it is the only one of that size
+static size_t largestComponent(const Vol3D<uint8> &mask, bool &unique)
+{
+  const int cx = mask.cx, cy = mask.cy, cz = mask.cz;
+  std::vector<uint8> visited(mask.size(),0);
+  std::vector<size_t> stack;
+  size_t largest = 0;
+  unique = false;
+  for (size_t i=0;i<mask.size();i++)
+  {
+    if (!mask[i] || visited[i]) continue;
+    size_t n = 0;
+    visited[i] = 1;
+    stack.push_back(i);
+    while (!stack.empty())
+    {
+      const size_t j = stack.back();
+      stack.pop_back();
+      n++;
+      const int x = j%cx, y = (j/cx)%cy, z = (int)(j/((size_t)cx*cy));
+      const size_t neighbors[6] = { j-1, j+1, j-cx, j+cx, j-(size_t)cx*cy, j+(size_t)cx*cy };
+      const bool inside[6] = { x>0, x<cx-1, y>0, y<cy-1, z>0, z<cz-1 };
+      for (int k=0;k<6;k++)
+        if (inside[k] && mask[neighbors[k]] && !visited[neighbors[k]])
+        {
+          visited[neighbors[k]] = 1;
+          stack.push_back(neighbors[k]);
+        }
+    }
+    if (n>largest) { largest = n; unique = true; }
+    else if (n==largest) unique = false;
+  }
+  return largest;
+}
+
+static bool sameMask(Vol3D<VBit> &a, Vol3D<VBit> &b)
+{
+  Vol3D<uint8> a8, b8;
+  a.decode(a8);
+  b.decode(b8);
+  return !memcmp(a8.start(),b8.start(),a8.size());
+}
+
+int main()
+{
+  std::mt19937 rng(3);
+  int nChecks = 0, nFailed = 0;
+  auto check = [&](const bool ok, const char *what, const int cx, const int cy, const int cz)
+  {
+    nChecks++;
+    if (!ok) { nFailed++; std::cout<<what<<" differs for "<<cx<<"x"<<cy<<"x"<<cz<<std::endl; }
+  };
+  for (int t=0;t<300;t++)
+  {
+    const int cx = 1+rng()%200, cy = 1+rng()%20, cz = 1+rng()%20;
+    Vol3D<uint8> mask;
+    mask.setsize(cx,cy,cz);
+    std::bernoulli_distribution density(0.2+0.1*(rng()%5));
+    for (size_t i=0;i<mask.size();i++) mask[i] = density(rng) ? 255 : 0;
+    bool unique = false;
+    const size_t largest = largestComponent(mask,unique);
+    Vol3D<VBit> reference;
+    for (int labeling : {RunLengthSegmenter::GraphLabeling,RunLengthSegmenter::UnionFindLabeling})
+      for (int nThreads : {1,2,3,4})
+      {
+        ThreadPool threadPool(nThreads);
+        RunLengthSegmenter segmenter;
+        segmenter.ensureCentered = false;
+        segmenter.labeling = (RunLengthSegmenter::Labeling)labeling;
+        segmenter.threadPool = &threadPool;
+        Vol3D<VBit> fg, bg;
+        fg.encode(mask);
+        bg.encode(mask);
+        segmenter.segmentFG(fg);
+        if (largest && unique)
+        {
+          Vol3D<uint8> fg8;
+          fg.decode(fg8);
+          size_t n = 0;
+          for (size_t i=0;i<fg8.size();i++) n += fg8[i]!=0;
+          check(n==largest && segmenter.labeledCount()==largest,"segmentFG",cx,cy,cz);
+        }
+        segmenter.segmentBG(bg);
+        if (reference.size()==0) reference.copy(bg);
+        else check(sameMask(bg,reference),"segmentBG",cx,cy,cz);
+      }
+  }
+  std::cout<<nFailed<<" of "<<nChecks<<" checks failed"<<std::endl;
+  return nFailed ? 1 : 0;
+}
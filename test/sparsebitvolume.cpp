@@ -0,0 +1,126 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+// Checks that SparseBitVolume matches the dense operators on random masks: encode/decode,
+// Morph32 step sequences, the boolean operations of vbit.h, count, and the largest component
+// found by RunLengthSegmenter.
+
+#include <vol3d.h>
+#include <vbit.h>
+#include <DS/morph32.h>
+#include <DS/sparsebitvolume.h>
+#include <DS/runlengthsegmenter.h>
+#include <random>
+#include <iostream>
+#include <cstring>
+
+// random noise of the given density, or a noisy ellipsoid filling about a third of the volume
+static void randomMask(Vol3D<uint8> &mask, std::mt19937 &rng, const int cx, const int cy, const int cz)
+{
+  mask.setsize(cx,cy,cz);
+  std::bernoulli_distribution b(0.02+0.1*(rng()%4));
+  const bool ellipsoid = rng()&1;
+  for (int z=0;z<cz;z++)
+    for (int y=0;y<cy;y++)
+      for (int x=0;x<cx;x++)
+      {
+        bool set = b(rng);
+        if (ellipsoid)
+        {
+          const double dx = (x-cx/2.0)/(cx/3.0+1), dy = (y-cy/2.0)/(cy/3.0+1), dz = (z-cz/2.0)/(cz/3.0+1);
+          set = (dx*dx+dy*dy+dz*dz<1) ^ (set && b(rng) && b(rng));
+        }
+        mask(x,y,z) = set ? 255 : 0;
+      }
+}
+
+static bool sameMask(Vol3D<VBit> &a, const SparseBitVolume &s)
+{
+  Vol3D<VBit> b;
+  Vol3D<uint8> a8, b8;
+  s.decode(b);
+  a.decode(a8);
+  b.decode(b8);
+  return a8.cx==b8.cx && a8.cy==b8.cy && a8.cz==b8.cz && !memcmp(a8.start(),b8.start(),a8.size());
+}
+
+static size_t count(Vol3D<VBit> &v)
+{
+  Vol3D<uint8> v8;
+  v.decode(v8);
+  size_t n = 0;
+  for (size_t i=0;i<v8.size();i++) n += v8[i]!=0;
+  return n;
+}
+
+int main()
+{
+  std::mt19937 rng(5);
+  int nChecks = 0, nFailed = 0;
+  auto check = [&](const bool ok, const char *what, const int cx, const int cy, const int cz)
+  {
+    nChecks++;
+    if (!ok) { nFailed++; std::cout<<what<<" differs for "<<cx<<"x"<<cy<<"x"<<cz<<std::endl; }
+  };
+  for (int t=0;t<200;t++)
+  {
+    const int cx = 1+rng()%200, cy = 1+rng()%23, cz = 1+rng()%23;
+    Vol3D<uint8> mask, mask2;
+    randomMask(mask,rng,cx,cy,cz);
+    randomMask(mask2,rng,cx,cy,cz);
+    ThreadPool threadPool(1+rng()%4);
+    Vol3D<VBit> d, d2;
+    d.encode(mask);
+    d2.encode(mask2);
+    SparseBitVolume s, s2;
+    s.threadPool = s2.threadPool = &threadPool;
+    s.encode(d);
+    s2.encode(d2);
+    check(sameMask(d,s),"encode",cx,cy,cz);
+    Morph32 morph;
+    morph.threadPool = &threadPool;
+    std::string steps;
+    const int nSteps = 1+rng()%6;
+    for (int i=0;i<nSteps;i++) steps += (rng()&1) ? 'C' : 'D';
+    if (rng()&1) { morph.dilate(d,steps); s.dilate(steps); }
+    else { morph.erode(d,steps); s.erode(steps); }
+    check(sameMask(d,s),steps.c_str(),cx,cy,cz);
+    switch (rng()%3)
+    {
+      case 0 : opAnd(d,d2); s.intersect(s2); break;
+      case 1 : opOr(d,d2); s.unite(s2); break;
+      default : setDifference(d,d2); s.subtract(s2); break;
+    }
+    check(sameMask(d,s),"boolean operation",cx,cy,cz);
+    check(count(d)==s.count(),"count",cx,cy,cz);
+    if (s.count())
+    {
+      RunLengthSegmenter segmenter;
+      segmenter.ensureCentered = false;
+      segmenter.segmentFG(d);
+      const size_t largest = s.selectLargestComponent();
+      // ties between components of the same size may be broken differently
+      if (segmenter.nRegions()<2 || segmenter.regionInfo[0].count!=segmenter.regionInfo[1].count)
+        check(sameMask(d,s) && largest==(size_t)segmenter.regionInfo[0].count,"largest component",cx,cy,cz);
+    }
+  }
+  std::cout<<nFailed<<" of "<<nChecks<<" checks failed"<<std::endl;
+  return nFailed ? 1 : 0;
+}
@@ -20,46 +20,41 @@
 //
 
 #include <DS/codec32.h>
+#include <cstddef>
 
-void Codec32::encode(const uint8 *data, uint32 *code, const int cx, const int cy, const int cz)
+void Codec32::encode(const uint8 *data, Word *code, const int cx, const int cy, const int cz)
 {
-  auto *cptr  = code;
-	for (int z=0;z<cz;z++)
-	{
-		for (int y=0;y<cy;y++)
-		{
-      auto *dptr = data + y*cx + cx*cy*z;
-      uint32 val = 0;
-			int p = 0;
-			for (int x=0;x<cx;x++,dptr++)
-			{
-        val>>=1;
-        val |= (uint32)((*dptr)&(0x01))<<31;
-				if (((++p) &= 0x1F)==0) { *cptr++ = val; }
-			}
-			if ((p)!=0) { *cptr++ = val>>(32-p); }
-		}
-	}
+  const int wordsPerLine = (cx + 63)/64;
+  const size_t nLines = (size_t)cy * cz;
+  for (size_t line=0;line<nLines;line++)
+  {
+    const uint8 *dptr = data + line*cx;
+    Word *cptr = code + line*wordsPerLine;
+    for (int w=0;w<wordsPerLine;w++)
+    {
+      const int x0 = w*64;
+      const int n = (cx - x0 < 64) ? (cx - x0) : 64;
+      Word val = 0;
+      for (int b=0;b<n;b++) val |= (Word)(dptr[x0+b]&0x01)<<b;
+      cptr[w] = val;
+    }
+  }
 }
 
-void Codec32::decode(const uint32 *code, uint8 *data, const int cx, const int cy, const int cz)
+void Codec32::decode(const Word *code, uint8 *data, const int cx, const int cy, const int cz)
 {
-  auto *cptr  = code;
-	for (int z=0;z<cz;z++)
-	{
-		for (int y=0;y<cy;y++)
-		{
-			uint8 *dptr = data + y*cx + cx*cy*z;
-      uint32 val=0;
-			int p = 0;
-			for (int x=0;x<cx;x++)
-			{
-				if (p==0) { val = *(cptr++); }
-				(++p) &= 0x1F;
-        *dptr++ = 0xFF * (val & 1);
-        val >>=1;
-			}
-		}
-	}
+  const int wordsPerLine = (cx + 63)/64;
+  const size_t nLines = (size_t)cy * cz;
+  for (size_t line=0;line<nLines;line++)
+  {
+    uint8 *dptr = data + line*cx;
+    const Word *cptr = code + line*wordsPerLine;
+    for (int w=0;w<wordsPerLine;w++)
+    {
+      const int x0 = w*64;
+      const int n = (cx - x0 < 64) ? (cx - x0) : 64;
+      const Word val = cptr[w];
+      for (int b=0;b<n;b++) dptr[x0+b] = 0xFF * (uint8)((val>>b) & 1);
+    }
+  }
 }
-
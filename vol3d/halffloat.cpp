@@ -0,0 +1,129 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#include <halffloat.h>
+#include <cpufeatures.h>
+#include <string.h>
+#if CPU_TARGET_SUPPORTED
+#include <immintrin.h>
+#endif
+
+const float HalfFloat::maxValue = 65504.0f;
+
+namespace {
+
+inline uint32 floatBits(const float f) { uint32 u; memcpy(&u,&f,sizeof(u)); return u; }
+inline float bitsFloat(const uint32 u) { float f; memcpy(&f,&u,sizeof(f)); return f; }
+
+typedef void (*FromFloatFn)(uint16 *, const float *, const size_t);
+typedef void (*ToFloatFn)(float *, const uint16 *, const size_t);
+
+void fromFloatScalar(uint16 *dst, const float *src, const size_t n)
+{
+  for (size_t i=0;i<n;i++) dst[i] = HalfFloat::fromFloat(src[i]);
+}
+
+void toFloatScalar(float *dst, const uint16 *src, const size_t n)
+{
+  for (size_t i=0;i<n;i++) dst[i] = HalfFloat::toFloat(src[i]);
+}
+
+#if CPU_TARGET_SUPPORTED
+CPU_TARGET_F16C void fromFloatF16C(uint16 *dst, const float *src, const size_t n)
+{
+  size_t i=0;
+  for (;i+8<=n;i+=8)
+    _mm_storeu_si128((__m128i *)(dst+i),_mm256_cvtps_ph(_mm256_loadu_ps(src+i),_MM_FROUND_TO_NEAREST_INT));
+  for (;i<n;i++) dst[i] = HalfFloat::fromFloat(src[i]);
+}
+
+CPU_TARGET_F16C void toFloatF16C(float *dst, const uint16 *src, const size_t n)
+{
+  size_t i=0;
+  for (;i+8<=n;i+=8)
+    _mm256_storeu_ps(dst+i,_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src+i))));
+  for (;i<n;i++) dst[i] = HalfFloat::toFloat(src[i]);
+}
+#endif
+
+FromFloatFn selectFromFloat()
+{
+#if CPU_TARGET_SUPPORTED
+  if (CPUFeatures::hasF16C()) return fromFloatF16C;
+#endif
+  return fromFloatScalar;
+}
+
+ToFloatFn selectToFloat()
+{
+#if CPU_TARGET_SUPPORTED
+  if (CPUFeatures::hasF16C()) return toFloatF16C;
+#endif
+  return toFloatScalar;
+}
+
+}
+
+uint16 HalfFloat::fromFloat(const float f)
+{
+  const uint32 infinity = 255u<<23;
+  const uint32 overflow = (127u+16)<<23; // 2^16; smaller values that round above maxValue carry into the exponent
+  const uint32 denormMagic = ((127u-15) + (23-10) + 1)<<23;
+  uint32 u = floatBits(f);
+  const uint32 sign = u & 0x80000000u;
+  u ^= sign;
+  uint32 h = 0;
+  if (u>=overflow)
+    h = (u>infinity) ? 0x7e00 : 0x7c00; // NaN or infinity
+  else if (u<(113u<<23))
+    h = floatBits(bitsFloat(u) + bitsFloat(denormMagic)) - denormMagic; // subnormal half, rounded by the float add
+  else
+  {
+    const uint32 odd = (u>>13) & 1;
+    u += ((uint32)(15-127)<<23) + 0xfff + odd;
+    h = u>>13;
+  }
+  return (uint16)(h | (sign>>16));
+}
+
+float HalfFloat::toFloat(const uint16 h)
+{
+  const uint32 exponentMask = 0x7c00u<<13;
+  uint32 u = (uint32)(h & 0x7fff)<<13;
+  const uint32 exponent = u & exponentMask;
+  u += (uint32)(127-15)<<23;
+  if (exponent==exponentMask)
+    u += (uint32)(128-16)<<23; // infinity or NaN
+  else if (exponent==0)
+    u = floatBits(bitsFloat(u + (1u<<23)) - bitsFloat(113u<<23)); // subnormal
+  return bitsFloat(u | ((uint32)(h & 0x8000)<<16));
+}
+
+void HalfFloat::fromFloat(uint16 *dst, const float *src, const size_t n)
+{
+  static const FromFloatFn fn = selectFromFloat();
+  fn(dst,src,n);
+}
+
+void HalfFloat::toFloat(float *dst, const uint16 *src, const size_t n)
+{
+  static const ToFloatFn fn = selectToFloat();
+  fn(dst,src,n);
+}
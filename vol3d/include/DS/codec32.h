@@ -22,12 +22,15 @@
 #ifndef Codec32_H
 #define Codec32_H
 
+#include <cstdint>
+
+// Packs byte masks into the bit layout of Vol3D<VBit>, which now uses 64-bit words.
 class Codec32 {
 public:
   typedef unsigned char uint8;
-  typedef unsigned int uint32;
-  static void encode(const uint8 *data, uint32 *code, const int cx, const int cy, const int cz);
-  static void decode(const uint32 *code, uint8 *data, const int cx, const int cy, const int cz);
+  typedef uint64_t Word;
+  static void encode(const uint8 *data, Word *code, const int cx, const int cy, const int cz);
+  static void decode(const Word *code, uint8 *data, const int cx, const int cy, const int cz);
 };
 
 #endif
@@ -24,17 +24,24 @@
 
 #include <vol3d.h>
 #include <vbit.h>
+#include <DS/threadpool.h>
+#include <functional>
+#include <string>
 
+// Binary dilation and erosion of Vol3D<VBit> volumes, 64 voxels per word. The R operators use the
+// 6-connected (diamond) element and the C operators the 3x3x3 cube; O2 applies R,R,C,C. The
+// slice passes and the slice combine loops run with AVX2 or AVX-512 when the CPU supports them,
+// and the slices are split among the threads of pool(); the results do not depend on the number
+// of threads. The two volume arguments of the operators must not overlap.
 class Morph32 {
 public:
-  void load(std::vector<uint32> &a, Vol3D<VBit> &v)
+  typedef VBit::Word Word;
+  void load(std::vector<Word> &a, Vol3D<VBit> &v)
   {
     const auto ds = v.size();
     for (size_t i=0;i<ds;i++) a[i] = v[i].data;
   }
-  Morph32() : cx(0), cy(0), cz(0), slicesize(0)
-  {
-  }
+  Morph32();
   ~Morph32() {}
   void releaseMemory();
   void init(int cx_, int cy_, int cz_);
@@ -47,54 +54,99 @@ public:
   {
     setup(v);
     load(volA,v);
-    return erodeR(&volA[0],v.raw32());
+    return erodeR(&volA[0],v.raw64());
   }
   bool dilateR(Vol3D<VBit> &v)
   {
     setup(v);
     load(volA,v);
-    return dilateR(&volA[0],v.raw32());
+    return dilateR(&volA[0],v.raw64());
   }
   bool erodeC(Vol3D<VBit> &v)
   {
     setup(v);
     load(volA,v);
-    return erodeC(&volA[0],v.raw32());
+    return erodeC(&volA[0],v.raw64());
   }
   bool dilateC(Vol3D<VBit> &v)
   {
     setup(v);
     load(volA,v);
-    return dilateC(&volA[0],v.raw32());
-  }
-  bool erodeO2(Vol3D<VBit> &v)
-  {
-    setup(v);
-    return erodeO2(v.raw32());
-  }
-  bool dilateO2(Vol3D<VBit> &v)
-  {
-    setup(v);
-    return dilateO2(v.raw32());
+    return dilateC(&volA[0],v.raw64());
   }
-  bool dilateO2(uint32 *a) { return dilateO2(a,a); }
-  bool erodeO2(uint32 *a) { return erodeO2(a,a); }
-  bool dilateO2(uint32 *a, uint32 *b);
-  bool erodeO2(uint32 *a, uint32 *b);
-  bool dilateC(uint32 *a, uint32 *b);
-  bool erodeC (uint32 *a, uint32 *b);
-  bool dilateR(uint32 *a, uint32 *b);
-  bool erodeR (uint32 *a, uint32 *b);
-  void dilateX32(uint32 *in, uint32 *out, const int cx, const int n);
-  void dilateY32(uint32 *in, uint32 *out, const int cx, const int cy, const int cz);
-  void erodeY32(uint32 *in, uint32 *out, const int cx, const int cy, const int cz);
-  void erodeX32(uint32 *in, uint32 *out, const int cx, const int n);
-  void dilateY32(uint32 *in, uint32 *inB, uint32 *out, const int cx, const int cy, const int cz);
-  void erodeY32(uint32 *in, uint32 *inB, uint32 *out, const int cx, const int cy, const int cz);
+  bool erodeO2(Vol3D<VBit> &v) { return erode(v,"DDCC"); }
+  bool dilateO2(Vol3D<VBit> &v) { return dilate(v,"DDCC"); }
+  // Applies a sequence of steps, 'D' for the diamond and 'C' for the cube (e.g., "DCDC"), in one
+  // pass over the volume. The result is the same as applying the R and C operators in turn, but
+  // each slab of slices goes through all of the steps while it is held in cacheBytes.
+  bool dilate(Vol3D<VBit> &v, const std::string &steps) { return applySequence(v,steps,true); }
+  bool erode(Vol3D<VBit> &v, const std::string &steps) { return applySequence(v,steps,false); }
+  // the nSteps alternating steps starting with the diamond ("DCDC...")
+  static std::string alternating(const int nSteps);
+  bool dilateO2(Word *a) { return dilateO2(a,a); }
+  bool erodeO2(Word *a) { return erodeO2(a,a); }
+  bool dilateO2(Word *a, Word *b);
+  bool erodeO2(Word *a, Word *b);
+  bool dilateC(Word *a, Word *b);
+  bool erodeC (Word *a, Word *b);
+  bool dilateR(Word *a, Word *b);
+  bool erodeR (Word *a, Word *b);
+  // Radius-independent operators that threshold a distance transform of the mask. The octagon
+  // operators give the same result as nSteps alternating dilateR/dilateC (or erodeR/erodeC) steps
+  // starting with R, as in the closing loops of mousebse; the ball operators use the Euclidean
+  // ball of the given radius. The structuring element is limited to distances below 65535
+  // (a radius of 255 for the ball).
+  bool dilateOctagon(Vol3D<VBit> &v, const int nSteps);
+  bool erodeOctagon(Vol3D<VBit> &v, const int nSteps);
+  bool dilateBall(Vol3D<VBit> &v, const float radius);
+  bool erodeBall(Vol3D<VBit> &v, const float radius);
+  // Dilation and erosion by a box or an ellipsoid whose radii along x, y and z are given in mm,
+  // using the voxel size of v, so that anisotropic volumes get the same physical element along
+  // each axis. The box is applied as one window of bit runs per axis, which takes a number of
+  // passes that grows with the log of its extent; the ellipsoid thresholds a weighted Euclidean
+  // distance transform. A radius below the voxel size leaves that axis unchanged.
+  enum Shape { Box, Ellipsoid };
+  bool dilateMM(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ);
+  bool erodeMM(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ);
+  // kernels for one slice and for combining slices, compiled for each instruction set
+  class Kernels {
+  public:
+    // X pass of in into scratch, then Y pass into out; cross takes the Y neighbors from in
+    void (*dilateSlice)(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask);
+    void (*erodeSlice)(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask);
+    void (*orPlanes)(Word *b, const Word *p, const Word *q, const size_t n);  // b |= p|q
+    void (*andPlanes)(Word *b, const Word *p, const Word *q, const size_t n); // b &= p&q
+    // as above with the previous value of b saved to prev, for combining a volume in place
+    void (*orRolling)(Word *b, Word *prev, const Word *next, const size_t n);
+    void (*andRolling)(Word *b, Word *prev, const Word *next, const size_t n);
+  };
+  static const Kernels &selectKernels();
+  size_t cacheBytes; // cache for the slab buffers of each worker in the step sequences
+  static const size_t defaultCacheBytes = 4<<20;
+  ThreadPool *threadPool; // pool that runs the operators (nullptr uses ThreadPool::global())
+  ThreadPool &pool() const { return threadPool ? *threadPool : ThreadPool::global(); }
 protected:
+  typedef std::function<void(const int z0, const int z1, Word *scratch)> SlabTask;
+  void runSlabs(const int first, const int last, const SlabTask &task);
+  // one step on the slices [z0,z1) of the sz slices at a, written to b
+  void cubeSlices(const Word *a, Word *b, const int z0, const int z1, const int sz, Word *scratch, const bool dilate);
+  void diamondSlices(const Word *a, Word *b, const int z0, const int z1, const int sz, Word *scratch, const bool dilate);
+  bool applySequence(Vol3D<VBit> &v, const std::string &steps, const bool dilate);
+  enum DistanceMetric { Octagon, Euclidean };
+  bool distanceMorphology(Vol3D<VBit> &v, const DistanceMetric metric, const int cubeRadius, const uint32 threshold, const bool dilate,
+                          const uint32 *weights=nullptr);
+  bool boxMorphology(Vol3D<VBit> &v, const int hx, const int hy, const int hz, const bool dilate); // half-widths in voxels
+  bool shapeMorphology(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ, const bool dilate);
   uint32 cx,cy,cz;
+  int wpl; // words per line
+  // The last word of each line keeps the bits up to the next multiple of 32 voxels, which the
+  // 32-bit layout used to hold, so that the results match the original implementation.
+  Word lastMask;
   size_t slicesize;
-  std::vector<uint32> sliceA,volA,volB;
+  const Kernels *kernels;
+  std::vector<Word> sliceA,volA,volB; // sliceA holds the scratch slices of each worker
+  std::vector<Word> slabBuffer; // slab, halo and scratch slices of each worker for applySequence
+  std::vector<uint16> distance;
 };
 
 #endif
@@ -27,8 +27,8 @@
 class RunLength {
 public:
   RunLength() : start(-1), stop(-1) {}
-  sint16 start;
-  sint16 stop;
+  sint32 start;
+  sint32 stop;
   bool intersects(const RunLength &r) const
   { return (start<=r.stop)&&(r.start<=stop); }
   bool neighbors(const RunLength &r) const
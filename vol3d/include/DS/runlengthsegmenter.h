@@ -27,19 +27,29 @@
 #include <vector>
 #include <DS/runlength.h>
 #include <DS/regioninfo.h>
+#include <DS/unionfind.h>
+#include <DS/threadpool.h>
 
 class RunLengthSegmenter {
 public:
   RunLengthSegmenter();
   ~RunLengthSegmenter();
   typedef int LabelType;
+  typedef VBit::Word Word;
   enum Mode { D6 = 0, D18 = 1, D26 = 2 };
+  // How the runs are grouped into regions: union-find over the touching runs, or the adjacency
+  // graph of the runs searched depth first. Both give the same labels. Union-find links the runs
+  // of separate slabs of slices on the threads of pool() and then joins the slabs at their
+  // boundary slices, which gives the same labels for any number of threads.
+  enum Labeling { UnionFindLabeling = 0, GraphLabeling = 1 };
   static int intersect(RunLength& r1, RunLength& r2);
   static bool regionInfoGE(const RegionInfo &ri, const RegionInfo &ri2);
   int labelID(const int x, const int y, const int z); // find the ID of a given voxel, if it has one
   void setup(const int cx_, const int cy_, const int cz_);
-  void label32FG(Vol3D<VBit> &imageOut) { label32FG(imageOut.raw32()); }
-  void label32BG(Vol3D<VBit> &imageOut) { label32BG(imageOut.raw32()); }
+  // write the selected regions to imageOut, returning the number of voxels that are set in it
+  size_t label32FG(Vol3D<VBit> &imageOut) { return label32FG(imageOut.raw64()); }
+  size_t label32BG(Vol3D<VBit> &imageOut) { return label32BG(imageOut.raw64()); }
+  size_t labeledCount() const { return labeledVoxels; } // voxels set by the last labeling, e.g., by segmentFG
   int regionCount(int n) const  
   {
     if (n<nregions)
@@ -50,12 +60,12 @@ public:
   int segmentFG(Vol3D<VBit> &v)
   {
     setup(v.cx,v.cy,v.cz);
-    return segment32FG(v.raw32(),v.raw32());
+    return segment32FG(v.raw64(),v.raw64());
   }
   void segmentBG(Vol3D<VBit> &v)
   {
     setup(v.cx,v.cy,v.cz);
-    segment32BG(v.raw32(),v.raw32());
+    segment32BG(v.raw64(),v.raw64());
   }
   std::vector<RegionInfo> regionInfo; // this should be behind an access function
   int CX() const { return cx; }
@@ -65,41 +75,52 @@ public:
   int presegmentFG(Vol3D<VBit> &v);
 
   Mode mode;
+  Labeling labeling;
+  ThreadPool *threadPool; // pool that encodes and links the runs (nullptr uses ThreadPool::global())
+  ThreadPool &pool() const { return threadPool ? *threadPool : ThreadPool::global(); }
   int cx;				// Image dimensions
   int cy;
   int cz;
 protected:
   void remap(std::vector<LabelType> &newMap);
-  int segmenttest32FG(uint8 *imageIn, uint32 *imageOut);
-  int segmenttest32FG(uint32 *imageIn, uint8 *imageOut);
+  int segmenttest32FG(uint8 *imageIn, Word *imageOut);
+  int segmenttest32FG(Word *imageIn, uint8 *imageOut);
   void segment(uint8 *imageIn, uint8 *imageOut, uint8 zero, uint8 one);
-  void label32FG(uint32 *imageOut);
-  void label32BG(uint32 *imageOut);
+  size_t label32FG(Word *imageOut);
+  size_t label32BG(Word *imageOut);
+  // Writes each line of imageOut in parallel, clearing it (foreground) or filling it up to cx
+  // (background) and then setting or clearing the selected runs with word masks.
+  template <bool foreground> size_t paintRuns(Word *imageOut);
 protected:
   void population();
   int findRegion(const int cx, const int cy, const int cz);
   void findmax();
   void makeGraph();
-  void makeGraph6();
-  void makeGraph26();
-  void makeGraph18();
+  // calls link(a,b) for the pairs of touching runs of slice z under the given connectivity, those
+  // within the slice and those with the previous slice
+  template <Mode connectivity, class Link> void linkRuns(Link &link, const int z, const bool withinSlice, const bool toPrevious);
   void label(uint8  *buffOut);
   void encode(uint8  *buffer);
-  void encode32FG(uint32 *imageIn);
-  void encode32BG(uint32 *imageIn);
-  void segment32FG(uint8 *imageIn, uint32 *imageOut);
-  int  segment32FG(uint32 *imageIn, uint32 *imageOut);
-  void segment32BG(uint8 *imageIn, uint32 *imageOut);
-  void segment32BG(uint32 *imageIn, uint32 *imageOut);
+  void encode32FG(Word *imageIn);
+  void encode32BG(Word *imageIn);
+  // Runs of set (foreground) or clear (background) bits, found a word at a time. The runs of each
+  // line are counted and then written in parallel, one slice per task.
+  template <bool foreground> void encodeWords(const Word *imageIn);
+  void segment32FG(uint8 *imageIn, Word *imageOut);
+  int  segment32FG(Word *imageIn, Word *imageOut);
+  void segment32BG(uint8 *imageIn, Word *imageOut);
+  void segment32BG(Word *imageIn, Word *imageOut);
 
-  std::vector<RunLength> runs;
+  std::vector<RunLength> runs; // grows with the number of runs found by the encoders
   std::vector<int> linestart; // start of an x scan-line
   std::vector<LabelType> map,newmap;
+  UnionFind unionFind;
 
   int nregions;
   uint8 high;
   uint8 low;
-  int datasize;
+  size_t datasize;
+  size_t labeledVoxels;
   int runcount;
   int nsymbols;
   bool verbose;
@@ -0,0 +1,103 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef SliceQueue_H
+#define SliceQueue_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// A bounded first-in first-out queue of image slices for passing a volume from one thread
+// to another. push blocks while the queue is full and pop blocks while it is empty, so the
+// producer can run at most capacity slices ahead of the consumer. Slices are copied in and
+// out of the queue outside of the lock.
+template <class T>
+class SliceQueue {
+public:
+  SliceQueue(const size_t sliceSize_, const int capacity_) :
+    sliceSize(sliceSize_), capacity(capacity_>0 ? capacity_ : 1), buffer(sliceSize*capacity),
+    head(0), count(0), closed(false)
+  {
+  }
+  // returns false if the queue was closed
+  bool push(const T *slice)
+  {
+    int slot = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notFull.wait(lock,[&]{ return closed || count<capacity; });
+      if (closed) return false;
+      slot = (head + count) % capacity;
+    }
+    std::copy(slice,slice + sliceSize,&buffer[slot*sliceSize]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      count++;
+    }
+    notEmpty.notify_one();
+    return true;
+  }
+  // returns false once the queue is empty and closed
+  bool pop(T *slice)
+  {
+    int slot = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notEmpty.wait(lock,[&]{ return closed || count>0; });
+      if (count==0) return false;
+      slot = head;
+    }
+    std::copy(&buffer[slot*sliceSize],&buffer[(slot+1)*sliceSize],slice);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      head = (head + 1) % capacity;
+      count--;
+    }
+    notFull.notify_one();
+    return true;
+  }
+  // Called by the producer after the last slice, or by the consumer to stop the producer.
+  // Slices already in the queue can still be popped.
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+private:
+  SliceQueue(const SliceQueue &) = delete;
+  SliceQueue &operator=(const SliceQueue &) = delete;
+  const size_t sliceSize;
+  const int capacity;
+  std::vector<T> buffer;
+  int head;
+  int count;
+  bool closed;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+};
+
+#endif
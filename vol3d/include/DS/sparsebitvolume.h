@@ -0,0 +1,89 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef SparseBitVolume_H
+#define SparseBitVolume_H
+
+#include <vol3d.h>
+#include <vbit.h>
+#include <DS/threadpool.h>
+#include <string>
+#include <vector>
+
+// Binary volume that stores only its non-empty bricks, each one 64-bit word of 4 lines in each of
+// 4 slices (64x4x4 voxels), with an index from brick position to storage. Words hold voxels as in
+// Vol3D<VBit>, and the operators use the same domain as Morph32 (including its padding of each
+// line to a multiple of 32 voxels), so the results match the dense operators bit for bit. Their
+// cost depends on the number of occupied bricks rather than on the size of the volume.
+class SparseBitVolume {
+public:
+  typedef VBit::Word Word;
+  static const int brickLines = 4;  // lines (y) per brick
+  static const int brickSlices = 4; // slices (z) per brick
+  static const int brickWords = brickLines*brickSlices;
+  SparseBitVolume();
+  bool setsize(const int cx_, const int cy_, const int cz_); // resizes and clears the volume
+  void clear();
+  bool encode(const Vol3D<VBit> &v);
+  bool decode(Vol3D<VBit> &v) const; // resizes v if its dimensions differ
+  size_t nBricks() const { return bricks.size(); }
+  size_t count() const; // number of voxels that are set
+// morphology, as the Morph32 operators of the same name
+  void dilateR() { step(true,false); }
+  void erodeR() { step(false,false); }
+  void dilateC() { step(true,true); }
+  void erodeC() { step(false,true); }
+  bool dilate(const std::string &steps) { return applySequence(steps,true); }
+  bool erode(const std::string &steps) { return applySequence(steps,false); }
+// boolean operations with a volume of the same dimensions
+  bool intersect(const SparseBitVolume &s); // this &= s
+  bool unite(const SparseBitVolume &s);     // this |= s
+  bool subtract(const SparseBitVolume &s);  // this &= ~s
+  // keeps the largest 6-connected component, returning its size in voxels; as with
+  // RunLengthSegmenter, the bits past cx are cleared
+  size_t selectLargestComponent();
+  ThreadPool *threadPool; // pool that runs the operators (nullptr uses ThreadPool::global())
+  ThreadPool &pool() const { return threadPool ? *threadPool : ThreadPool::global(); }
+  int cx,cy,cz;
+protected:
+  // The index has a border of empty bricks, so that the neighbors of any brick can be looked up
+  // directly; brick IDs are positions in the index.
+  size_t brickID(const int bxi, const int byi, const int bzi) const { return ((size_t)(bzi+1)*(by+2) + byi+1)*(bx+2) + bxi+1; }
+  void brickCoords(const size_t id, int &bxi, int &byi, int &bzi) const
+  {
+    bxi = (int)(id%(bx+2)) - 1;
+    byi = (int)((id/(bx+2))%(by+2)) - 1;
+    bzi = (int)(id/((size_t)(bx+2)*(by+2))) - 1;
+  }
+  void step(const bool dilate, const bool cube);
+  bool applySequence(const std::string &steps, const bool dilate);
+  template <class Op> bool combine(const SparseBitVolume &s, const bool keepUnmatched, const bool addUnmatched, Op op);
+  void setBricks(const std::vector<size_t> &ids, std::vector<Word> &data); // takes data, dropping the empty bricks
+  int bx,by,bz; // bricks per axis
+  int wpl;      // words per line
+  Word lastMask;
+  Word lineEndMask; // the bits of the last word of each line that lie within cx
+  std::vector<sint32> index;  // storage slot of each brick, -1 for an empty brick
+  std::vector<size_t> bricks; // brick ID of each slot, in increasing order
+  std::vector<Word> words;    // brickWords words per slot, word (y&3) + 4*(z&3)
+  std::vector<Word> spare;    // storage reused for the results of the operators
+};
+
+#endif
@@ -0,0 +1,66 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef ThreadPool_H
+#define ThreadPool_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that execute indexed tasks.
+// run(nTasks,fn) calls fn(task,worker) for each task in [0,nTasks) and returns once all
+// tasks have finished. The calling thread takes part as worker 0, so worker indices are
+// in [0,size()) and can be used to address per-thread scratch space. Tasks are handed out
+// dynamically, so callers must not rely on the order in which they are executed.
+// Calls to run from inside a task are executed serially on the calling worker.
+class ThreadPool {
+public:
+  typedef std::function<void(int task, int worker)> Task;
+  ThreadPool(int nThreads=0); // 0 selects defaultThreadCount()
+  ~ThreadPool();
+  int size() const { return nThreads; }
+  void run(const int nTasks, const Task &fn);
+  static int defaultThreadCount();
+  static ThreadPool &global(); // shared pool, created on first use with defaultThreads workers
+  static int defaultThreads;   // 0 uses all hardware threads
+private:
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+  void workerLoop(const int worker);
+  void execute(const int worker);
+  int nThreads;
+  std::vector<std::thread> workers;
+  std::mutex runMutex;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const Task *job;
+  int jobTasks;
+  std::atomic<int> nextTask;
+  int active;
+  size_t generation;
+  bool stopping;
+};
+
+#endif
@@ -0,0 +1,78 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef UnionFind_H
+#define UnionFind_H
+
+#include <vol3ddatatypes.h>
+#include <utility>
+#include <vector>
+
+// Disjoint sets of the elements [0,n), with union by rank and path compression.
+class UnionFind {
+public:
+  void reset(const int n)
+  {
+    parent.resize(n);
+    rank.assign(n,0);
+    for (int i=0;i<n;i++) parent[i] = i;
+  }
+  int find(int a)
+  {
+    int root = a;
+    while (parent[root]!=root) root = parent[root];
+    while (parent[a]!=root)
+    {
+      const int next = parent[a];
+      parent[a] = root;
+      a = next;
+    }
+    return root;
+  }
+  void unite(int a, int b)
+  {
+    a = find(a);
+    b = find(b);
+    if (a==b) return;
+    if (rank[a]<rank[b]) std::swap(a,b);
+    parent[b] = a;
+    if (rank[a]==rank[b]) rank[a]++;
+  }
+  // Numbers the sets 1,2,... in the order of their lowest elements, as Graph::makemap numbers the
+  // components of a graph, and writes the number of each element to map. Returns the number of sets.
+  int makemap(int *map)
+  {
+    const int n = (int)parent.size();
+    for (int i=0;i<n;i++) map[i] = 0;
+    int nLabels = 0;
+    for (int i=0;i<n;i++)
+    {
+      const int root = find(i);
+      if (map[root]==0) map[root] = ++nLabels;
+      map[i] = map[root];
+    }
+    return nLabels;
+  }
+private:
+  std::vector<int> parent;
+  std::vector<uint8> rank;
+};
+
+#endif
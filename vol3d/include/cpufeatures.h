@@ -0,0 +1,92 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef CPUFeatures_H
+#define CPUFeatures_H
+
+// Runtime detection of the x86 vector extensions used by the optimized kernels.
+// Functions that are compiled for a specific instruction set are tagged with
+// CPU_TARGET_AVX2 or CPU_TARGET_AVX512 and must only be called when the
+// corresponding query below returns true; CPU_TARGET_F16C adds the half-precision
+// conversions to AVX2. Shared kernel bodies should be marked
+// CPU_INLINE so that they are compiled for the instruction set of each caller.
+// On compilers or architectures where per-function targets are unavailable
+// (e.g., MSVC, arm64), CPU_TARGET_SUPPORTED is 0 and callers should use their
+// portable code paths.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_TARGET_SUPPORTED 1
+#define CPU_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx2,fma")))
+#define CPU_TARGET_F16C __attribute__((target("avx2,fma,f16c")))
+#define CPU_INLINE inline __attribute__((always_inline))
+#include <cpuid.h>
+#else
+#define CPU_TARGET_SUPPORTED 0
+#define CPU_TARGET_AVX2
+#define CPU_TARGET_AVX512
+#define CPU_TARGET_F16C
+#define CPU_INLINE inline
+#endif
+
+class CPUFeatures {
+public:
+  static bool hasAVX2()
+  {
+#if CPU_TARGET_SUPPORTED
+    static const bool flag = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return flag;
+#else
+    return false;
+#endif
+  }
+  static bool hasAVX512()
+  {
+#if CPU_TARGET_SUPPORTED
+    static const bool flag = hasAVX2() && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vl");
+    return flag;
+#else
+    return false;
+#endif
+  }
+  // half-precision conversions; checked with cpuid, since not all compilers accept "f16c" in
+  // __builtin_cpu_supports
+  static bool hasF16C()
+  {
+#if CPU_TARGET_SUPPORTED
+    static const bool flag = hasAVX2() && []() {
+      unsigned int a=0, b=0, c=0, d=0;
+      return __get_cpuid(1,&a,&b,&c,&d) && (c & bit_F16C)!=0;
+    }();
+    return flag;
+#else
+    return false;
+#endif
+  }
+  static const char *bestName()
+  {
+    if (hasAVX512()) return "AVX-512";
+    if (hasAVX2()) return "AVX2";
+    return "scalar";
+  }
+};
+
+#endif
@@ -0,0 +1,40 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#ifndef HalfFloat_H
+#define HalfFloat_H
+
+#include <vol3ddatatypes.h>
+#include <stddef.h>
+
+// Conversion between float and IEEE 754 half precision (binary16), stored as uint16.
+// Floats are rounded to the nearest half, with ties to even; values beyond the half range
+// become infinity. The array conversions use F16C when the CPU supports it, and the
+// portable conversions give the same results.
+class HalfFloat {
+public:
+  static uint16 fromFloat(const float f);
+  static float toFloat(const uint16 h);
+  static void fromFloat(uint16 *dst, const float *src, const size_t n);
+  static void toFloat(float *dst, const uint16 *src, const size_t n);
+  static const float maxValue; // largest finite half, 65504
+};
+
+#endif
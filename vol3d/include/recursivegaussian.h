@@ -0,0 +1,42 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+
+#ifndef RecursiveGaussian_H
+#define RecursiveGaussian_H
+
+#include <stddef.h>
+
+// Fourth-order recursive approximation of Gaussian smoothing (R. Deriche, "Recursively
+// implementing the Gaussian and its derivatives," INRIA RR-1893, 1993). The output is the sum
+// of a causal and an anti-causal filter, each costing the same few operations per sample for
+// any sigma. Samples outside the signal are treated as zero.
+class RecursiveGaussian {
+public:
+  RecursiveGaussian(const float sigma);
+  // filters the columns of nLines rows of width samples, lineStride apart, in place.
+  // Each step updates a whole row, so this vectorizes across the row.
+  void filterAcross(float *x, const int nLines, const ptrdiff_t lineStride, const int width) const;
+  float n[4]; // causal input coefficients for x[k],x[k-1],x[k-2],x[k-3]
+  float m[4]; // anti-causal input coefficients for x[k+1],...,x[k+4]
+  float d[4]; // feedback coefficients for y[k-+1],...,y[k-+4]
+};
+
+#endif
@@ -0,0 +1,45 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+
+#ifndef SeparableConvolution_H
+#define SeparableConvolution_H
+
+#include <vector>
+
+// Vectorized 1D convolution with symmetric kernels, for the separable Gaussian and
+// LoG passes. A kernel of radius r is stored folded as its r+1 coefficients h[0..r],
+// with h[0] at the center, so each pair of taps costs one add and one multiply-add.
+// Rows are processed in float and many output columns are computed at once, using
+// AVX-512 or AVX2 with FMA when the CPU supports them.
+class SeparableConvolution {
+public:
+  // out[j] = h[0]*rows[r][j] + sum_{m=1..r} h[m]*(rows[r-m][j] + rows[r+m][j]) for j in [0,n).
+  // rows holds the 2r+1 input rows in order. If accumulate is set, the result is added to out.
+  static void acrossRows(float *out, const float *const *rows, const float *h, const int r, const int n,
+                         const bool accumulate);
+  // out[j] = h[0]*in[j] + sum_{m=1..r} h[m]*(in[j-m] + in[j+m]) for j in [0,n); in[-r..n+r) must be readable.
+  static void alongRow(float *out, const float *in, const float *h, const int r, const int n, const bool accumulate);
+  // converts a symmetric kernel of odd length to folded form
+  static std::vector<float> fold(const std::vector<double> &kernel);
+  static const char *instructionSetName();
+};
+
+#endif
@@ -24,11 +24,16 @@
 #include <vol3d.h>
 #include <DS/codec32.h>
 
+// Binary volumes are packed into 64-bit words, one run of words per x scan-line; bit b of word w
+// holds voxel x=64*w+b. The bits past the end of a line are not part of the volume.
 class VBit {
 public:
+  typedef Codec32::Word Word;
+  static const int wordBits = 64;
+  static size_t wordsPerLine(const size_t cx) { return (cx + wordBits - 1)/wordBits; }
   VBit() {}
-  VBit(uint32 data):data(data){}
-  uint32 data; // place holder
+  VBit(Word data):data(data){}
+  Word data;
 };
 
 template<> inline Vol3DBase::dim_type Vol3D<VBit>::size() const
@@ -53,10 +58,10 @@ inline bool setDiff(Vol3D<VBit> &dst, Vol3D<VBit> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] ^= (d[i]&s[i]);
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] ^= (d[i]&s[i]);
     return true;
   }
   else
@@ -76,7 +81,7 @@ template<> inline bool Vol3D<VBit>::encode(const Vol3D<uint8> &mask)
   if (makeCompatible(mask)==false) return false;
   description = mask.description;
   std::fill(data.begin(),data.end(),VBit(0)); // TODO: check if necessary
-  Codec32::encode(mask.start(),raw32(),cx,cy,cz);
+  Codec32::encode(mask.start(),raw64(),cx,cy,cz);
   return true;
 }
 
@@ -84,15 +89,13 @@ template<> inline bool Vol3D<VBit>::decode(Vol3D<uint8> &mask)
 {
   if (mask.makeCompatible(*this)==false) return false;
   mask.description = description;
-  Codec32::decode(raw32(),mask.start(),cx,cy,cz);
+  Codec32::decode(raw64(),mask.start(),cx,cy,cz);
   return true;
 }
 
 template<> inline bool Vol3D<VBit>::setsize(const dim_type cx_, const dim_type cy_, const dim_type cz_)
 {
-  auto wpl = (cx_/32);
-  if (wpl*32 != cx_) wpl++;
-  const auto nElements = wpl * cy_ * cz_;
+  const auto nElements = VBit::wordsPerLine(cx_) * cy_ * cz_;
   data.resize(nElements);
   if (data.size()==nElements)
   {
@@ -112,10 +115,10 @@ inline bool opAnd(Vol3D<VBit> &dst, Vol3D<VBit> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] &= s[i];
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] &= s[i];
     return true;
   }
   else
@@ -126,10 +129,10 @@ inline bool opAnd(Vol3D<uint8> &dst, Vol3D<uint8> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
+    const size_t ds = dst.size();
     auto *d = dst.start();
     auto *s = src.start();
-    for (int i=0;i<ds;i++) d[i] &= s[i];
+    for (size_t i=0;i<ds;i++) d[i] &= s[i];
     return true;
   }
   else
@@ -140,10 +143,10 @@ inline bool copy(Vol3D<VBit> &dst, const Vol3D<VBit> &src)
 {
   if (dst.makeCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] = s[i];
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] = s[i];
     return true;
   }
   else
@@ -154,10 +157,10 @@ inline bool opOr(Vol3D<VBit> &dst, const Vol3D<VBit> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] |= s[i];
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] |= s[i];
     return true;
   }
   else
@@ -168,10 +171,10 @@ inline bool opAnd(Vol3D<VBit> &dst, const Vol3D<VBit> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] &= s[i];
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] &= s[i];
     return true;
   }
   else
@@ -183,10 +186,10 @@ inline bool setDifference(Vol3D<VBit> &dst, const Vol3D<VBit> &src)
 {
   if (dst.isCompatible(src))
   {
-    int ds = dst.size();
-    auto *d = dst.raw32();
-    auto *s = src.craw32();
-    for (int i=0;i<ds;i++) d[i] &= (d[i] ^ s[i]);
+    const size_t ds = dst.size();
+    auto *d = dst.raw64();
+    auto *s = src.craw64();
+    for (size_t i=0;i<ds;i++) d[i] &= (d[i] ^ s[i]);
     return true;
   }
   else
@@ -40,6 +40,9 @@ public:
   static double scaleToUint8(Vol3D<uint8> &vb, const Vol3D<sint16> &vs);
   static double scaleToUint8(Vol3D<uint8> &vb, const Vol3D<float32> &vf);
   static double scaleToUint8(Vol3D<uint8> &vb, const Vol3D<float64> &vf);
+  // scale factor that scaleToUint8 would apply, without producing the 8-bit volume
+  static double uint8Scale(const Vol3D<uint16> &vs);
+  static double uint8Scale(const Vol3D<float32> &vf);
   static uint16 u16clamp(const float32 f) { return (f<65535) ? ((f>=0) ? (uint16)f : 0) : 65535; }
   static uint16 u16clamp(const float64 f) { return (f<65535) ? ((f>=0) ? (uint16)f : 0) : 65535; }
 };
@@ -21,196 +21,318 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <DS/morph32.h>
+#include <cpufeatures.h>
 
-void Morph32::erodeX32(uint32 *in, uint32 *out, const int cx, const int n)
+typedef Morph32::Word Word;
+
+// Bit b of a word is voxel 64*w+b, so shifting left moves voxels to +x. The carries between
+// words come from the top bit of the previous word and the bottom bit of the next.
+template <bool dilate>
+CPU_INLINE Word xWord(const Word x, const Word y, const Word z)
 {
-  const int extra = (cx&0x1F);
-  const int wpl  = ((cx>>5)-1) + (extra ? 1 : 0);
-  for (int i=0;i<n;i++)
-  {
-    uint32 x = 0;
-    uint32 y = *in;
-    for (int j=0;j<wpl;j++)
-    {
-      uint32 z = *++in;
-      *out++ = y & ((x>>31)|(y<<1)) & ((y>>1)|(z<<31));
-      x = y;
-      y = z;
-    }
-    { *out++ = y & ((x>>31)|(y<<1)) & (y>>1); ++in; }
-  }
+  return dilate ? (y | (y<<1) | (y>>1) | (x>>63) | (z<<63))
+                : (y & ((x>>63)|(y<<1)) & ((y>>1)|(z<<63)));
 }
 
-void Morph32::dilateX32(uint32 *in, uint32 *out, const int cx, const int n)
+template <bool dilate>
+CPU_INLINE void xPass(const Word * __restrict in, Word * __restrict out, const int wpl, const int n, const Word lastMask)
 {
-  const int extra = (cx&0x1F);
-  const int wpl  = ((cx>>5)-1) + (extra ? 1 : 0);
-
-  for (int i=0;i<n;i++)
+  for (int i=0;i<n;i++, in+=wpl, out+=wpl)
   {
-    uint32 x = 0;
-    uint32 y = *in;
-    for (int j=0;j<wpl;j++)
-    {
-      uint32 z = *++in;
-      *out++ = y | (y<<1) | (y>>1) | (x>>31) | (z<<31);
-      x = y;
-      y = z;
-    }
-    { *out++ = y | (y<<1) | (y>>1) | (x>>31); ++in; }
+    if (wpl==1) { out[0] = xWord<dilate>(0,in[0],0) & lastMask; continue; }
+    out[0] = xWord<dilate>(0,in[0],in[1]);
+    for (int j=1;j<wpl-1;j++) out[j] = xWord<dilate>(in[j-1],in[j],in[j+1]);
+    out[wpl-1] = xWord<dilate>(in[wpl-2],in[wpl-1],0) & lastMask;
   }
 }
 
-void Morph32::dilateY32(uint32 *in, uint32 *out, const int cx, const int cy, const int cz)
+// Y pass of one slice: the center line comes from i and its neighbors from ib. Erosion clears
+// the first and last lines.
+template <bool dilate>
+CPU_INLINE void yPass(const Word * __restrict i, const Word * __restrict ib, Word * __restrict o, const int wpl, const int cy)
 {
-  const int wpl  = (cx>>5) + ((cx&0x1F)!=0);
-  const int ys = cy - 1;
-  uint32 *o = out;
-  uint32 *i = in;
-  for (int z=0;z<cz;z++)
+  if (cy==1)
   {
-    for (int x=0;x<wpl;x++,o++,i++) o[0] = i[0] | i[wpl];
-    for (int y=1;y<ys;y++)
-    {
-      for (int x=0;x<wpl;x++,o++,i++)
-        o[0] = i[-wpl] | i[0] | i[wpl];
-    }
-    for (int x=0;x<wpl;x++,o++,i++) o[0] = i[-wpl] | i[0];
+    for (int x=0;x<wpl;x++) o[x] = dilate ? i[x] : 0;
+    return;
   }
+  const size_t last = (size_t)(cy-1)*wpl;
+  for (int x=0;x<wpl;x++) o[x] = dilate ? (i[x] | ib[x+wpl]) : 0;
+  for (size_t j=wpl;j<last;j++)
+    o[j] = dilate ? (ib[j-wpl] | i[j] | ib[j+wpl]) : (ib[j-wpl] & i[j] & ib[j+wpl]);
+  for (int x=0;x<wpl;x++) o[last+x] = dilate ? (ib[last+x-wpl] | i[last+x]) : 0;
 }
 
-void Morph32::erodeY32(uint32 *in, uint32 *out, const int cx, const int cy, const int cz)
+template <bool dilate>
+CPU_INLINE void slicePass(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask)
 {
-  const int wpl  = (cx>>5) + ((cx&0x1F)!=0);
-  const int ys = cy - 1;
-  uint32 *o = out;
-  uint32 *i = in;
-  for (int z=0;z<cz;z++)
-  {
-    for (int x=0;x<wpl;x++,o++,i++) o[0] = 0;
-    for (int y=1;y<ys;y++)
-    {
-      for (int x=0;x<wpl;x++,o++,i++)
-        o[0] = i[-wpl] & i[0] & i[wpl];
-    }
-    for (int x=0;x<wpl;x++,o++,i++) o[0] = 0;
-  }
+  xPass<dilate>(in,scratch,wpl,cy,lastMask);
+  yPass<dilate>(scratch,cross ? in : scratch,out,wpl,cy);
 }
 
-void Morph32::dilateY32(uint32 *in, uint32 *inB, uint32 *out, const int cx, const int cy, const int cz)
+template <bool dilate>
+CPU_INLINE void combinePlanes(Word * __restrict b, const Word * __restrict p, const Word * __restrict q, const size_t n)
 {
-  const int wpl  = (cx>>5) + ((cx&0x1F)!=0);
-  const int ys = cy - 1;
-  uint32 *o = out;
-  uint32 *i = in;
-  uint32 *ib = inB;
-  for (int z=0;z<cz;z++)
-  {
-    for (int x=0;x<wpl;x++,o++,i++,ib++) o[0] = i[0] | ib[wpl];
-    for (int y=1;y<ys;y++)
-    {
-      for (int x=0;x<wpl;x++,o++,i++,ib++)
-        o[0] = ib[-wpl] | i[0] | ib[wpl];
-    }
-    for (int x=0;x<wpl;x++,o++,i++,ib++) o[0] = ib[-wpl] | i[0];
-  }
+  for (size_t j=0;j<n;j++) b[j] = dilate ? (b[j] | p[j] | q[j]) : (b[j] & p[j] & q[j]);
 }
 
-void Morph32::erodeY32(uint32 *in, uint32 *inB, uint32 *out, const int cx, const int cy, const int cz)
+template <bool dilate>
+CPU_INLINE void combineRolling(Word * __restrict b, Word * __restrict prev, const Word * __restrict next, const size_t n)
 {
-  const int wpl  = (cx>>5) + ((cx&0x1F)!=0);
-  const int ys = cy - 1;
-  uint32 *o = out;
-  uint32 *i = in;
-  uint32 *ib= inB;
-  for (int z=0;z<cz;z++)
+  for (size_t j=0;j<n;j++)
   {
-    for (int x=0;x<wpl;x++,o++) o[0] = 0;
-    i += wpl; ib += wpl;
-    for (int y=1;y<ys;y++)
-    {
-      for (int x=0;x<wpl;x++,o++,i++,ib++)
-        o[0] = ib[-wpl] & i[0] & ib[wpl];
-    }
-    for (int x=0;x<wpl;x++,o++) o[0] = 0;
-    i += wpl; ib += wpl;
+    const Word t = b[j];
+    b[j] = dilate ? (t | prev[j] | next[j]) : (t & prev[j] & next[j]);
+    prev[j] = t;
   }
 }
 
-bool Morph32::dilateC(uint32 *ina, uint32 *inb)
+template <bool dilate>
+CPU_TARGET_AVX512 static void slicePassAVX512(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask)
 {
-  const int sz = cz;
-  uint32 *a=ina, *b=inb;
-  for (int i=0;i<sz;i++)
+  slicePass<dilate>(in,out,scratch,cross,wpl,cy,lastMask);
+}
+
+template <bool dilate>
+CPU_TARGET_AVX512 static void combinePlanesAVX512(Word *b, const Word *p, const Word *q, const size_t n)
+{
+  combinePlanes<dilate>(b,p,q,n);
+}
+
+template <bool dilate>
+CPU_TARGET_AVX512 static void combineRollingAVX512(Word *b, Word *prev, const Word *next, const size_t n)
+{
+  combineRolling<dilate>(b,prev,next,n);
+}
+
+template <bool dilate>
+CPU_TARGET_AVX2 static void slicePassAVX2(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask)
+{
+  slicePass<dilate>(in,out,scratch,cross,wpl,cy,lastMask);
+}
+
+template <bool dilate>
+CPU_TARGET_AVX2 static void combinePlanesAVX2(Word *b, const Word *p, const Word *q, const size_t n)
+{
+  combinePlanes<dilate>(b,p,q,n);
+}
+
+template <bool dilate>
+CPU_TARGET_AVX2 static void combineRollingAVX2(Word *b, Word *prev, const Word *next, const size_t n)
+{
+  combineRolling<dilate>(b,prev,next,n);
+}
+
+template <bool dilate>
+static void slicePassScalar(const Word *in, Word *out, Word *scratch, const bool cross, const int wpl, const int cy, const Word lastMask)
+{
+  slicePass<dilate>(in,out,scratch,cross,wpl,cy,lastMask);
+}
+
+template <bool dilate>
+static void combinePlanesScalar(Word *b, const Word *p, const Word *q, const size_t n)
+{
+  combinePlanes<dilate>(b,p,q,n);
+}
+
+template <bool dilate>
+static void combineRollingScalar(Word *b, Word *prev, const Word *next, const size_t n)
+{
+  combineRolling<dilate>(b,prev,next,n);
+}
+
+const Morph32::Kernels &Morph32::selectKernels()
+{
+  static const Kernels avx512 = {
+    slicePassAVX512<true>, slicePassAVX512<false>, combinePlanesAVX512<true>, combinePlanesAVX512<false>,
+    combineRollingAVX512<true>, combineRollingAVX512<false> };
+  static const Kernels avx2 = {
+    slicePassAVX2<true>, slicePassAVX2<false>, combinePlanesAVX2<true>, combinePlanesAVX2<false>,
+    combineRollingAVX2<true>, combineRollingAVX2<false> };
+  static const Kernels scalar = {
+    slicePassScalar<true>, slicePassScalar<false>, combinePlanesScalar<true>, combinePlanesScalar<false>,
+    combineRollingScalar<true>, combineRollingScalar<false> };
+  if (CPUFeatures::hasAVX512()) return avx512;
+  if (CPUFeatures::hasAVX2()) return avx2;
+  return scalar;
+}
+
+Morph32::Morph32() : cacheBytes(defaultCacheBytes), threadPool(nullptr), cx(0), cy(0), cz(0), wpl(0), lastMask(~(Word)0), slicesize(0), kernels(&selectKernels())
+{
+}
+
+// Splits the slices [first,last) into one slab per worker. Each worker has three slices of
+// scratch space in sliceA.
+void Morph32::runSlabs(const int first, const int last, const SlabTask &task)
+{
+  const int n = last - first;
+  if (n<=0) return;
+  ThreadPool &threads = pool();
+  const int nSlabs = std::min(n,threads.size());
+  const size_t scratchSize = 3*slicesize;
+  if (sliceA.size()<scratchSize*threads.size()) sliceA.resize(scratchSize*threads.size());
+  threads.run(nSlabs,[&](const int slab, const int worker) {
+    const int z0 = first + (int)((int64_t)n*slab/nSlabs);
+    const int z1 = first + (int)((int64_t)n*(slab+1)/nSlabs);
+    task(z0,z1,&sliceA[scratchSize*worker]);
+  });
+}
+
+// The cube is separable, so each slice is filtered in x and y and then combined with the filtered
+// slices above and below it. The slices just outside [z0,z1) are filtered again rather than
+// taken from the slabs next to it, so the result does not depend on how the slices are split.
+void Morph32::cubeSlices(const Word *ina, Word *inb, const int z0, const int z1, const int sz, Word *scratch, const bool dilate)
+{
+  const auto slicePass = dilate ? kernels->dilateSlice : kernels->erodeSlice;
+  const auto rolling = dilate ? kernels->orRolling : kernels->andRolling;
+  Word *prev = scratch + slicesize; // filtered slice below the one being combined
+  Word *next = scratch + 2*slicesize;
+  bool havePrev = (z0>0);
+  if (havePrev) slicePass(ina + slicesize*(z0-1),prev,scratch,false,wpl,cy,lastMask);
+  // combines b with the filtered slices below (prev) and above (t, nullptr at the top)
+  auto combine = [&](Word *b, const Word *t) {
+    if (!havePrev)
+    {
+      std::copy_n(b,slicesize,prev);
+      if (!dilate) std::fill_n(b,slicesize,0);
+      else if (t) kernels->orPlanes(b,t,t,slicesize);
+      havePrev = true;
+    }
+    else if (t)
+      rolling(b,prev,t,slicesize);
+    else if (dilate)
+      kernels->orPlanes(b,prev,prev,slicesize);
+    else
+      std::fill_n(b,slicesize,0);
+  };
+  for (int i=z0;i<z1;i++)
   {
-    dilateX32(a,&sliceA[0],cx,cy);
-    dilateY32(&sliceA[0],b,cx,cy,1);
-    a += slicesize;
-    b += slicesize;
+    Word *b = inb + slicesize*i;
+    slicePass(ina + slicesize*i,b,scratch,false,wpl,cy,lastMask);
+    if (i>z0) combine(b - slicesize,b);
   }
-  b = inb;
-  for (int j=0;j<slicesize;j++)
+  const Word *above = nullptr;
+  if (z1<sz)
   {
-    sliceA[j] = b[j];  b[j] |= b[j+slicesize];
+    slicePass(ina + slicesize*z1,next,scratch,false,wpl,cy,lastMask);
+    above = next;
   }
-  b += slicesize;
-  for (int i=1;i<sz-1;i++)
+  combine(inb + slicesize*(z1-1),above);
+}
+
+// The diamond takes its z neighbors from the input, so each slice is finished as soon as its
+// x and y passes are done, independently of the others. Erosion clears the first and last slices.
+void Morph32::diamondSlices(const Word *ina, Word *inb, const int z0, const int z1, const int sz, Word *scratch, const bool dilate)
+{
+  for (int i=z0;i<z1;i++)
   {
-    for (int j=0;j<slicesize;j++)
+    const Word *a = ina + slicesize*i;
+    Word *b = inb + slicesize*i;
+    if (dilate)
     {
-      uint32 t = b[j];
-      b[j] |= sliceA[j] | b[j+slicesize];
-      sliceA[j] = t;
+      kernels->dilateSlice(a,b,scratch,true,wpl,cy,lastMask);
+      if (sz<2) continue;
+      const Word *below = (i>0) ? a - slicesize : a + slicesize;
+      const Word *above = (i<sz-1) ? a + slicesize : a - slicesize;
+      kernels->orPlanes(b,below,above,slicesize);
+    }
+    else if (i==0 || i==sz-1)
+      std::fill_n(b,slicesize,0);
+    else
+    {
+      kernels->erodeSlice(a,b,scratch,true,wpl,cy,lastMask);
+      kernels->andPlanes(b,a - slicesize,a + slicesize,slicesize);
     }
-    b += slicesize;
-  }
-  for (int j=0;j<slicesize;j++)
-  {
-    b[j] |= sliceA[j];
   }
-  return true;
 }
 
-bool Morph32::erodeC (uint32 *ina, uint32 *inb)
+// Runs the steps of the sequence on slabs of slices, each loaded with a halo of one slice per
+// step on either side. Step s only updates the slices that the halo still covers after s steps,
+// and the slices at the ends of the volume are handled as in the single operators, so the slab
+// ends up with the same values as the step by step result.
+bool Morph32::applySequence(Vol3D<VBit> &v, const std::string &steps, const bool dilate)
 {
-  const int sz = cz;
-  uint32 *a=ina, *b=inb;
-  for (int i=0;i<sz;i++)
+  for (const char c : steps)
   {
-    erodeX32(a,&sliceA[0],cx,cy);
-    erodeY32(&sliceA[0],b,cx,cy,1);
-    a += slicesize;
-    b += slicesize;
-  }
-  b = inb;
-  for (int j=0;j<slicesize;j++)
-  {
-    sliceA[j] = b[j];  b[j] = 0;
-  }
-  b += slicesize;
-  for (int i=1;i<sz-1;i++)
-  {
-    for (int j=0;j<slicesize;j++)
+    if (c!='D' && c!='C')
     {
-      uint32 t = b[j];
-      b[j] &= sliceA[j] & b[j+slicesize];
-      sliceA[j] = t;
+      std::cerr<<"Morph32: unknown step '"<<c<<"' in sequence "<<steps<<std::endl;
+      return false;
     }
-    b += slicesize;
-  }
-  for (int j=0;j<slicesize;j++)
-  {
-    b[j] = 0;
   }
+  setup(v);
+  const int sz = cz;
+  const int nSteps = (int)steps.size();
+  if (nSteps==0 || sz==0 || slicesize==0) return true;
+  ThreadPool &threads = pool();
+  const int halo = nSteps;
+  // two copies of the slab and its halo should fit in cacheBytes; slabs at least twice as thick
+  // as the halo keep the work repeated in the halos below half of the total
+  const int fitSlices = (int)std::min<size_t>(cacheBytes/(2*slicesize*sizeof(Word)),sz);
+  const int perThread = (sz + threads.size() - 1)/threads.size();
+  const int slab = std::min(sz,std::max(2*halo,std::min(fitSlices - 2*halo,perThread)));
+  const int nSlabs = (sz + slab - 1)/slab;
+  const int slabSlices = std::min(sz,slab + 2*halo);
+  const size_t bufferSize = (2*(size_t)slabSlices + 3)*slicesize;
+  if (slabBuffer.size()<bufferSize*threads.size()) slabBuffer.resize(bufferSize*threads.size());
+  load(volA,v);
+  const Word *in = &volA[0];
+  Word *out = v.raw64();
+  threads.run(nSlabs,[&](const int k, const int worker) {
+    const int z0 = k*slab;
+    const int z1 = std::min(sz,z0 + slab);
+    const int lo = std::max(0,z0 - halo);
+    const int hi = std::min(sz,z1 + halo);
+    const int n = hi - lo;
+    Word *a = &slabBuffer[bufferSize*worker];
+    Word *b = a + slicesize*slabSlices;
+    Word *scratch = b + slicesize*slabSlices;
+    std::copy_n(in + slicesize*lo,slicesize*n,a);
+    for (int s=1;s<=nSteps;s++)
+    {
+      const int first = (lo>0) ? s : 0;
+      const int last = (hi<sz) ? n - s : n;
+      if (steps[s-1]=='D')
+        diamondSlices(a,b,first,last,n,scratch,dilate);
+      else
+        cubeSlices(a,b,first,last,n,scratch,dilate);
+      std::swap(a,b);
+    }
+    std::copy_n(a + slicesize*(z0-lo),slicesize*(z1-z0),out + slicesize*z0);
+  });
+  return true;
+}
+
+std::string Morph32::alternating(const int nSteps)
+{
+  std::string steps;
+  for (int i=0;i<nSteps;i++) steps += (i&1) ? 'C' : 'D';
+  return steps;
+}
+
+bool Morph32::dilateC(Word *ina, Word *inb)
+{
+  runSlabs(0,cz,[&](const int z0, const int z1, Word *scratch) { cubeSlices(ina,inb,z0,z1,cz,scratch,true); });
   return true;
 }
+
+bool Morph32::erodeC (Word *ina, Word *inb)
+{
+  runSlabs(0,cz,[&](const int z0, const int z1, Word *scratch) { cubeSlices(ina,inb,z0,z1,cz,scratch,false); });
+  return true;
+}
+
 void Morph32::releaseMemory()
 {
   cx=cy=cz=slicesize=0;
-  sliceA=std::vector<uint32>();
-  volA=std::vector<uint32>();
-  volB=std::vector<uint32>();
+  wpl=0;
+  sliceA=std::vector<Word>();
+  volA=std::vector<Word>();
+  volB=std::vector<Word>();
+  slabBuffer=std::vector<Word>();
+  distance=std::vector<uint16>();
 }
 
 void Morph32::init(int cx_, int cy_, int cz_)
@@ -218,89 +340,27 @@ void Morph32::init(int cx_, int cy_, int cz_)
   cx = cx_;
   cy = cy_;
   cz = cz_;
-  const int extra = (cx&0x1F);
-  const int wpl  = (cx>>5);
-  const int wx = wpl + (extra!=0);
-  if ((int)(wx*cy)!=slicesize)
-  {
-    slicesize = wx*cy;
-    sliceA.resize(slicesize); // refactor to be container or smart pointer
-    volA.resize(slicesize*cz);
-    volB.resize(slicesize*cz);
-  }
+  wpl = (int)VBit::wordsPerLine(cx);
+  const int extra = (cx&0x3F);
+  lastMask = (extra>0 && extra<=32) ? (Word)0xFFFFFFFF : ~(Word)0;
+  slicesize = (size_t)wpl*cy;
+  volA.resize(slicesize*cz);
+  volB.resize(slicesize*cz);
 }
 
-bool Morph32::dilateR(uint32 *ina, uint32 *inb)
+bool Morph32::dilateR(Word *ina, Word *inb)
 {
-  const int sz = cz;
-  uint32 *a = ina;
-  uint32 *b = inb;
-  for (int i=0;i<sz;i++)
-  {
-    dilateX32(a,&sliceA[0],cx,cy);
-    dilateY32(&sliceA[0],a,b,cx,cy,1);
-    a += slicesize;
-    b += slicesize;
-  }
-  b = inb;
-  uint32 *c = ina + slicesize;
-  for (int j=0;j<slicesize;j++)
-  {
-    b[j] |= c[j];
-  }
-  b += slicesize;
-  c += slicesize;
-  a = ina;
-  for (int i=1;i<sz-1;i++)
-  {
-    for (int j=0;j<slicesize;j++)
-    {
-      b[j] |= a[j]|c[j];
-    }
-    a += slicesize;
-    b += slicesize;
-    c += slicesize;
-  }
-  for (int j=0;j<slicesize;j++)
-  {
-    b[j] |= a[j];
-  }
+  runSlabs(0,cz,[&](const int z0, const int z1, Word *scratch) { diamondSlices(ina,inb,z0,z1,cz,scratch,true); });
   return true;
 }
 
-bool Morph32::erodeR (uint32 *ina, uint32 *inb)
+bool Morph32::erodeR (Word *ina, Word *inb)
 {
-  const int sz = cz;
-  uint32 *d = inb + slicesize*(sz-1);
-  for (int i=0;i<slicesize;i++) { inb[i]=0; d[i] = 0; }
-  uint32 *a = ina+slicesize;
-  uint32 *b = inb+slicesize;
-  for (int i=1;i<sz-1;i++)
-  {
-    erodeX32(a,&sliceA[0],cx,cy);
-    erodeY32(&sliceA[0],a,b,cx,cy,1);
-    a += slicesize;
-    b += slicesize;
-  }
-  a = ina;
-  b = inb;
-  uint32 *c = ina + slicesize*2;
-  b += slicesize;
-  // set first and last slice to 0.
-  for (int i=1;i<sz-1;i++)
-  {
-    for (int j=0;j<slicesize;j++)
-    {
-      b[j] &= a[j]&c[j];
-    }
-    a += slicesize;
-    b += slicesize;
-    c += slicesize;
-  }
+  runSlabs(0,cz,[&](const int z0, const int z1, Word *scratch) { diamondSlices(ina,inb,z0,z1,cz,scratch,false); });
   return true;
 }
 
-bool Morph32::dilateO2(uint32 *a, uint32 *b)
+bool Morph32::dilateO2(Word *a, Word *b)
 {
   dilateR(   a,&volA[0]);
   dilateR(&volA[0],&volB[0]);
@@ -309,7 +369,7 @@ bool Morph32::dilateO2(uint32 *a, uint32 *b)
   return true;
 }
 
-bool Morph32::erodeO2(uint32 *a, uint32 *b)
+bool Morph32::erodeO2(Word *a, Word *b)
 {
   erodeR(       a,&volA[0]);
   erodeR(&volA[0],&volB[0]);
@@ -0,0 +1,256 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <DS/morph32.h>
+
+// Radius-independent dilation and erosion. The set (or, for erosion, its complement together with
+// everything outside the volume) is turned into a distance map with one separable pass per axis,
+// which is then thresholded. Distances are saturated at threshold+1, which does not change any
+// value at or below the threshold, so they fit in 16 bits.
+
+namespace {
+
+typedef Morph32::Word Word;
+const int tileLines = 16;
+
+// The line functions work on K interleaved lines, f[i*K+k] being sample i of line k, so that the
+// y and z passes handle K neighboring columns together.
+
+// Minimum over the window [i-b,i+b] for the n samples that follow pad samples of padding (pad>=b,
+// with the same amount after them), using the van Herk / Gil-Werman block scheme, which takes 3
+// comparisons per sample for any b. g and h are scratch of the same size as f.
+template <int K>
+void windowMin(uint32 *f, uint32 *g, uint32 *h, const int n, const int pad, const int b)
+{
+  if (b<=0) return;
+  const int m = n + 2*pad;
+  const int w = 2*b+1;
+  for (int i0=0;i0<m;i0+=w)
+  {
+    const int i1 = std::min(i0+w,m);
+    for (int k=0;k<K;k++) g[i0*K+k] = f[i0*K+k];
+    for (int i=i0+1;i<i1;i++)
+      for (int k=0;k<K;k++) g[i*K+k] = std::min(g[(i-1)*K+k],f[i*K+k]);
+    for (int k=0;k<K;k++) h[(i1-1)*K+k] = f[(i1-1)*K+k];
+    for (int i=i1-2;i>=i0;i--)
+      for (int k=0;k<K;k++) h[i*K+k] = std::min(h[(i+1)*K+k],f[i*K+k]);
+  }
+  for (int i=pad;i<pad+n;i++)
+    for (int k=0;k<K;k++) f[i*K+k] = std::min(h[(i-b)*K+k],g[(i+b)*K+k]);
+}
+
+// L1 (city block) distance along the lines, including the padding.
+template <int K>
+void cityBlock(uint32 *f, const int m)
+{
+  for (int i=1;i<m;i++)
+    for (int k=0;k<K;k++) f[i*K+k] = std::min(f[i*K+k],f[(i-1)*K+k]+1);
+  for (int i=m-2;i>=0;i--)
+    for (int k=0;k<K;k++) f[i*K+k] = std::min(f[i*K+k],f[(i+1)*K+k]+1);
+}
+
+inline int64_t floorDiv(const int64_t a, const int64_t b)
+{
+  const int64_t q = a/b;
+  return (q*b!=a && (a<0)!=(b<0)) ? q-1 : q;
+}
+
+// Squared Euclidean distance along the line from squared distances f (Meijster et al., 2000),
+// with steps along the line weighted by w. s and t are scratch of length m; the result replaces f.
+void lowerEnvelope(uint32 *f, int *s, int *t, uint32 *out, const int m, const int64_t w)
+{
+  auto dist = [&](const int64_t x, const int i) { return w*(x-i)*(x-i) + (int64_t)f[i]; };
+  int q = 0;
+  s[0] = 0;
+  t[0] = 0;
+  for (int u=1;u<m;u++)
+  {
+    while (q>=0 && dist(t[q],s[q])>dist(t[q],u)) q--;
+    if (q<0)
+    {
+      q = 0;
+      s[0] = u;
+    }
+    else
+    {
+      const int64_t i = s[q];
+      const int64_t sep = 1 + floorDiv(w*((int64_t)u*u - i*i) + (int64_t)f[u] - (int64_t)f[i],2*w*(u - i));
+      if (sep<m)
+      {
+        q++;
+        s[q] = u;
+        t[q] = (int)sep;
+      }
+    }
+  }
+  for (int u=m-1;u>=0;u--)
+  {
+    out[u] = (uint32)std::min<int64_t>(dist(u,s[q]),0xFFFFFFFFu);
+    if (u==t[q]) q--;
+  }
+  std::copy_n(out,m,f);
+}
+
+}
+
+bool Morph32::dilateOctagon(Vol3D<VBit> &v, const int nSteps)
+{
+  if (nSteps<=0) return true;
+  return distanceMorphology(v,Octagon,nSteps/2,(nSteps+1)/2,true);
+}
+
+bool Morph32::erodeOctagon(Vol3D<VBit> &v, const int nSteps)
+{
+  if (nSteps<=0) return true;
+  return distanceMorphology(v,Octagon,nSteps/2,(nSteps+1)/2,false);
+}
+
+bool Morph32::dilateBall(Vol3D<VBit> &v, const float radius)
+{
+  if (radius<1) return true;
+  return distanceMorphology(v,Euclidean,0,(uint32)std::floor((double)radius*radius),true);
+}
+
+bool Morph32::erodeBall(Vol3D<VBit> &v, const float radius)
+{
+  if (radius<1) return true;
+  return distanceMorphology(v,Euclidean,0,(uint32)std::floor((double)radius*radius),false);
+}
+
+// For the octagon, the distance from x to y is sum_i max(|x_i-y_i|-cubeRadius,0): the cube steps
+// absorb up to cubeRadius voxels of each offset and the diamond steps cover the rest in the L1
+// norm, so x is reached by the steps when this distance is at most the number of diamond steps.
+// Each axis is a window minimum followed by a city block transform. The Euclidean distance uses
+// the lower envelope of parabolas on the second and third axes. Either way the work per voxel
+// does not depend on the radius. weights scale the squared Euclidean steps along x, y and z
+// (nullptr for unit weights).
+bool Morph32::distanceMorphology(Vol3D<VBit> &v, const DistanceMetric metric, const int cubeRadius,
+                                 const uint32 threshold, const bool dilate, const uint32 *weights)
+{
+  static const uint32 unitWeights[3] = { 1, 1, 1 };
+  if (!weights) weights = unitWeights;
+  if (threshold>=0xFFFF)
+  {
+    std::cerr<<"Morph32: structuring element is too large for the distance transform"<<std::endl;
+    return false;
+  }
+  setup(v);
+  // the voxels up to the next multiple of 32 take part, as they do in the step operators
+  const int nx = (lastMask==(Word)0xFFFFFFFF) ? wpl*64 - 32 : wpl*64;
+  const int ny = cy, nz = cz;
+  const size_t sliceVoxels = (size_t)nx*ny;
+  const uint16 cap = (uint16)(threshold + 1);
+  const uint32 padValue = dilate ? cap : 0;  // voxels outside the volume
+  const int pad = std::max(cubeRadius,1);
+  distance.resize(sliceVoxels*nz);
+  ThreadPool &threads = pool();
+  const int maxLength = std::max(nx,std::max(ny,nz)) + 2*pad;
+  const size_t scratchSize = (size_t)maxLength*(3*tileLines + 3);
+  std::vector<uint32> lineScratch(threads.size()*scratchSize);
+  Word *words = v.raw64();
+
+  // transforms the line of n voxels at start with the given stride (K=1, the first axis) or the
+  // K lines that follow it in memory
+  auto transformLines = [&]<int K>(uint16 *start, const size_t stride, const int n, const int nLines, const int axis, const int worker) {
+    uint32 *f = &lineScratch[(size_t)worker*scratchSize];
+    uint32 *g = f + (size_t)maxLength*K, *h = g + (size_t)maxLength*K, *out = h + (size_t)maxLength*K;
+    int *s = (int *)(out + maxLength), *t = s + maxLength;
+    const int m = n + 2*pad;
+    std::fill_n(f,(size_t)pad*K,padValue);
+    std::fill_n(f + (size_t)(pad+n)*K,(size_t)pad*K,padValue);
+    for (int i=0;i<n;i++)
+    {
+      uint32 *fi = f + (size_t)(pad+i)*K;
+      const uint16 *src = start + i*stride;
+      for (int k=0;k<nLines;k++) fi[k] = src[k];
+      for (int k=nLines;k<K;k++) fi[k] = padValue;
+    }
+    if (metric==Octagon)
+    {
+      windowMin<K>(f,g,h,n,pad,cubeRadius);
+      cityBlock<K>(f,m);
+    }
+    else if (K==1)
+    {
+      cityBlock<K>(f,m);
+      for (int i=pad;i<pad+n;i++) f[i] = (uint32)std::min<uint64_t>((uint64_t)weights[axis]*f[i]*f[i],cap);
+    }
+    else
+    {
+      for (int k=0;k<nLines;k++)
+      {
+        for (int i=0;i<m;i++) g[i] = f[i*K+k];
+        lowerEnvelope(g,s,t,out,m,weights[axis]);
+        for (int i=0;i<m;i++) f[i*K+k] = g[i];
+      }
+    }
+    for (int i=0;i<n;i++)
+    {
+      const uint32 *fi = f + (size_t)(pad+i)*K;
+      uint16 *dst = start + i*stride;
+      for (int k=0;k<nLines;k++) dst[k] = (uint16)std::min(fi[k],(uint32)cap);
+    }
+  };
+
+  // x and y within each slice
+  threads.run(nz,[&](const int z, const int worker) {
+    uint16 *slice = &distance[sliceVoxels*z];
+    const Word *src = words + slicesize*z;
+    for (int y=0;y<ny;y++)
+    {
+      const Word *line = src + (size_t)y*wpl;
+      uint16 *d = slice + (size_t)y*nx;
+      for (int x=0;x<nx;x++)
+      {
+        const bool bit = (line[x>>6]>>(x&63))&1;
+        d[x] = (bit==dilate) ? 0 : cap;
+      }
+      transformLines.template operator()<1>(d,1,nx,1,0,worker);
+    }
+    for (int x=0;x<nx;x+=tileLines)
+      transformLines.template operator()<tileLines>(slice + x,nx,ny,std::min(tileLines,nx-x),1,worker);
+  });
+  // z, one task per row
+  threads.run(ny,[&](const int y, const int worker) {
+    for (int x=0;x<nx;x+=tileLines)
+      transformLines.template operator()<tileLines>(&distance[(size_t)y*nx + x],sliceVoxels,nz,std::min(tileLines,nx-x),2,worker);
+  });
+  threads.run(nz,[&](const int z, const int /*worker*/) {
+    const uint16 *slice = &distance[sliceVoxels*z];
+    Word *dst = words + slicesize*z;
+    for (int y=0;y<ny;y++)
+    {
+      const uint16 *d = slice + (size_t)y*nx;
+      Word *line = dst + (size_t)y*wpl;
+      for (int w=0;w<wpl;w++)
+      {
+        const int x0 = w*64;
+        const int n = std::min(64,nx - x0);
+        Word bits = 0;
+        for (int b=0;b<n;b++) bits |= (Word)((d[x0+b]<=threshold)==dilate)<<b;
+        line[w] = bits;
+      }
+    }
+  });
+  return true;
+}
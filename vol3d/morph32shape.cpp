@@ -0,0 +1,214 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <DS/morph32.h>
+
+// Structuring elements given in mm. The box is separable, so it is applied as a window along each
+// axis in turn. Each window is built by doubling: the OR (AND) over 2n positions is the one over n
+// positions combined with itself shifted by n, so a window of any length takes a number of passes
+// that grows with the log of the length. Along x the positions are bits and the shifts run across
+// words; along y and z they are whole lines and slices.
+
+namespace {
+
+typedef Morph32::Word Word;
+const size_t columnWords = 128; // words of each slice handled together in the z pass
+
+template <bool dilate> inline Word combine(const Word a, const Word b) { return dilate ? (a|b) : (a&b); }
+
+// bit x of the result is bit x+k of the line of n words at src, the bits outside the line being 0
+inline Word shiftedWord(const Word *src, const int n, const int w, const int k)
+{
+  const int q = w + (k>>6), r = k&63;
+  const Word lo = (q>=0 && q<n) ? src[q] : 0;
+  if (!r) return lo;
+  const Word hi = (q+1>=0 && q+1<n) ? src[q+1] : 0;
+  return (lo>>r)|(hi<<(64-r));
+}
+
+// bit x of dst, for the nOut words of dst, is the OR (AND) of the bits x, ..., x+length-1 of the
+// line of n words at p, which is overwritten
+template <bool dilate>
+void bitWindow(Word *p, Word *dst, const int n, const int nOut, const int length)
+{
+  int covered = 0;
+  for (int span=1,bits=length;bits;bits>>=1,span*=2)
+  {
+    if (bits&1)
+    {
+      if (covered==0) std::copy_n(p,nOut,dst);
+      else for (int w=0;w<nOut;w++) dst[w] = combine<dilate>(dst[w],shiftedWord(p,n,w,covered));
+      covered += span;
+    }
+    if (bits==1) break;
+    // p covers span positions; the words that are shifted in are read before they are overwritten
+    for (int w=0;w<n;w++) p[w] = combine<dilate>(p[w],shiftedWord(p,n,w,span));
+  }
+}
+
+// b = b OR (AND) block j of the n blocks of m words at src, the blocks past n being 0
+template <bool dilate>
+inline void combineBlock(Word *b, const Word *src, const int j, const int n, const size_t m)
+{
+  if (j<n)
+  {
+    const Word *s = src + j*m;
+    for (size_t k=0;k<m;k++) b[k] = combine<dilate>(b[k],s[k]);
+  }
+  else if (!dilate)
+    std::fill_n(b,m,0);
+}
+
+// as bitWindow, for blocks of m words
+template <bool dilate>
+void blockWindow(Word *p, Word *dst, const int n, const int nOut, const size_t m, const int length)
+{
+  int covered = 0;
+  for (int span=1,bits=length;bits;bits>>=1,span*=2)
+  {
+    if (bits&1)
+    {
+      if (covered==0) std::copy_n(p,nOut*m,dst);
+      else for (int i=0;i<nOut;i++) combineBlock<dilate>(dst + i*m,p,i+covered,n,m);
+      covered += span;
+    }
+    if (bits==1) break;
+    for (int i=0;i<n;i++) combineBlock<dilate>(p + i*m,p,i+span,n,m);
+  }
+}
+
+// The centered windows of half-width h are the windows of length 2h+1 over the data preceded by
+// h empty positions, which p holds.
+template <bool dilate>
+void centeredBitWindow(Word *line, Word *p, const int n, const int h)
+{
+  const int np = n + h/64 + 1;
+  for (int w=0;w<np;w++) p[w] = shiftedWord(line,n,w,-h);
+  bitWindow<dilate>(p,line,np,n,2*h+1);
+}
+
+template <bool dilate>
+void centeredBlockWindow(Word *p, Word *dst, const int n, const size_t m, const int h)
+{
+  std::fill_n(p,h*m,0);
+  blockWindow<dilate>(p,dst,n+h,n,m,2*h+1);
+}
+
+template <bool dilate>
+void boxPasses(Word *words, const int wpl, const int cy, const int cz, const size_t slicesize, const Word lastMask,
+               int hx, int hy, int hz, ThreadPool &threads)
+{
+  // wider windows give the same result
+  hx = std::min(hx,wpl*64);
+  hy = std::min(hy,cy);
+  hz = std::min(hz,cz);
+  const size_t m = std::min(columnWords,slicesize);
+  const size_t sliceScratch = std::max((size_t)(wpl + hx/64 + 1),(size_t)(cy + hy)*wpl);
+  const size_t scratchSize = std::max(sliceScratch,(size_t)(2*cz + hz)*m);
+  std::vector<Word> scratch(threads.size()*scratchSize);
+  // the bits past the domain of each line are cleared first
+  threads.run(cz,[&](const int z, const int worker) {
+    Word *slice = words + slicesize*z;
+    Word *p = &scratch[worker*scratchSize];
+    for (int y=0;y<cy;y++)
+    {
+      Word *line = slice + (size_t)y*wpl;
+      line[wpl-1] &= lastMask;
+      if (hx<=0) continue;
+      centeredBitWindow<dilate>(line,p,wpl,hx);
+      line[wpl-1] &= lastMask;
+    }
+    if (hy>0)
+    {
+      std::copy_n(slice,slicesize,p + hy*wpl);
+      centeredBlockWindow<dilate>(p,slice,cy,wpl,hy);
+    }
+  });
+  if (hz>0)
+  {
+    const int nColumns = (int)((slicesize + columnWords - 1)/columnWords);
+    threads.run(nColumns,[&](const int c, const int worker) {
+      const size_t c0 = c*columnWords;
+      const size_t mc = std::min(columnWords,slicesize - c0);
+      Word *p = &scratch[worker*scratchSize], *column = p + (cz + hz)*mc;
+      for (int z=0;z<cz;z++) std::copy_n(words + slicesize*z + c0,mc,p + (hz+z)*mc);
+      centeredBlockWindow<dilate>(p,column,cz,mc,hz);
+      for (int z=0;z<cz;z++) std::copy_n(column + z*mc,mc,words + slicesize*z + c0);
+    });
+  }
+}
+}
+
+bool Morph32::dilateMM(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ)
+{
+  return shapeMorphology(v,shape,radiusX,radiusY,radiusZ,true);
+}
+
+bool Morph32::erodeMM(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ)
+{
+  return shapeMorphology(v,shape,radiusX,radiusY,radiusZ,false);
+}
+
+bool Morph32::boxMorphology(Vol3D<VBit> &v, const int hx, const int hy, const int hz, const bool dilate)
+{
+  setup(v);
+  if (dilate)
+    boxPasses<true>(v.raw64(),wpl,cy,cz,slicesize,lastMask,hx,hy,hz,pool());
+  else
+    boxPasses<false>(v.raw64(),wpl,cy,cz,slicesize,lastMask,hx,hy,hz,pool());
+  return true;
+}
+
+// The ellipsoid holds the offsets d with sum_i (d_i*voxel_i/radius_i)^2 <= 1. Scaled by
+// ellipsoidScale, this is a weighted squared distance with integer weights, which are rounded
+// down, so the element includes every offset that it should and is exact to within
+// 1/weight. An axis whose radius is below the voxel size gets a weight above the threshold.
+bool Morph32::shapeMorphology(Vol3D<VBit> &v, const Shape shape, const float radiusX, const float radiusY, const float radiusZ,
+                              const bool dilate)
+{
+  const float radius[3] = { radiusX, radiusY, radiusZ };
+  const float voxel[3] = { v.rx>0 ? v.rx : 1.0f, v.ry>0 ? v.ry : 1.0f, v.rz>0 ? v.rz : 1.0f };
+  if (radiusX<0 || radiusY<0 || radiusZ<0)
+  {
+    std::cerr<<"Morph32: structuring element radii must not be negative"<<std::endl;
+    return false;
+  }
+  if (shape==Box)
+  {
+    int h[3];
+    for (int i=0;i<3;i++) h[i] = (int)std::floor(radius[i]/voxel[i] + 1e-4f);
+    if (h[0]==0 && h[1]==0 && h[2]==0) return true;
+    return boxMorphology(v,h[0],h[1],h[2],dilate);
+  }
+  const uint32 ellipsoidScale = 0xFFFE;
+  uint32 weights[3];
+  bool active = false;
+  for (int i=0;i<3;i++)
+  {
+    const double e = (radius[i]>0) ? (double)voxel[i]/radius[i] : 2.0;
+    weights[i] = (uint32)std::clamp(std::floor(ellipsoidScale*e*e),1.0,(double)ellipsoidScale + 1);
+    active |= (weights[i]<=ellipsoidScale);
+  }
+  if (!active) return true;
+  return distanceMorphology(v,Euclidean,0,ellipsoidScale,dilate,weights);
+}
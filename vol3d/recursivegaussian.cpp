@@ -0,0 +1,137 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+
+#include <recursivegaussian.h>
+#include <cpufeatures.h>
+#include <cmath>
+#include <vector>
+
+namespace {
+
+// out[j] = sum_k c[k]*x[k][j] - sum_k d[k]*y[k][j], k=0..3
+CPU_INLINE void recursiveStepBody(float * __restrict out, const float *const *x, const float *c, const float *const *y,
+                                  const float *d, const int n)
+{
+  const float * __restrict x0 = x[0];
+  const float * __restrict x1 = x[1];
+  const float * __restrict x2 = x[2];
+  const float * __restrict x3 = x[3];
+  const float * __restrict y0 = y[0];
+  const float * __restrict y1 = y[1];
+  const float * __restrict y2 = y[2];
+  const float * __restrict y3 = y[3];
+  const float c0=c[0], c1=c[1], c2=c[2], c3=c[3];
+  const float d0=d[0], d1=d[1], d2=d[2], d3=d[3];
+  for (int j=0;j<n;j++)
+    out[j] = c0*x0[j] + c1*x1[j] + c2*x2[j] + c3*x3[j] - (d0*y0[j] + d1*y1[j] + d2*y2[j] + d3*y3[j]);
+}
+
+typedef void (*RecursiveStepFn)(float *, const float *const *, const float *, const float *const *, const float *, const int);
+
+void recursiveStepScalar(float *out, const float *const *x, const float *c, const float *const *y, const float *d, const int n)
+{
+  recursiveStepBody(out,x,c,y,d,n);
+}
+
+#if CPU_TARGET_SUPPORTED
+CPU_TARGET_AVX512 void recursiveStepAVX512(float *out, const float *const *x, const float *c, const float *const *y,
+                                           const float *d, const int n)
+{
+  recursiveStepBody(out,x,c,y,d,n);
+}
+
+CPU_TARGET_AVX2 void recursiveStepAVX2(float *out, const float *const *x, const float *c, const float *const *y,
+                                       const float *d, const int n)
+{
+  recursiveStepBody(out,x,c,y,d,n);
+}
+#endif
+
+RecursiveStepFn selectRecursiveStep()
+{
+#if CPU_TARGET_SUPPORTED
+  if (CPUFeatures::hasAVX512()) return recursiveStepAVX512;
+  if (CPUFeatures::hasAVX2()) return recursiveStepAVX2;
+#endif
+  return recursiveStepScalar;
+}
+
+}
+
+// Coefficients as in ITK's RecursiveGaussianImageFilter, normalized to unit gain.
+RecursiveGaussian::RecursiveGaussian(const float sigma)
+{
+  const double A1 = 1.3530, B1 = 1.8151, W1 = 0.6681, L1 = -1.3932;
+  const double A2 = -0.3531, B2 = 0.0902, W2 = 2.0787, L2 = -1.3732;
+  const double sin1 = std::sin(W1/sigma), sin2 = std::sin(W2/sigma);
+  const double cos1 = std::cos(W1/sigma), cos2 = std::cos(W2/sigma);
+  const double exp1 = std::exp(L1/sigma), exp2 = std::exp(L2/sigma);
+  const double N0 = A1 + A2;
+  const double N1 = exp2*(B2*sin2 - (A2 + 2*A1)*cos2) + exp1*(B1*sin1 - (A1 + 2*A2)*cos1);
+  const double N2 = 2*exp1*exp2*((A1 + A2)*cos2*cos1 - B1*cos2*sin1 - B2*cos1*sin2) + A2*exp1*exp1 + A1*exp2*exp2;
+  const double N3 = exp2*exp1*exp1*(B2*sin2 - A2*cos2) + exp1*exp2*exp2*(B1*sin1 - A1*cos1);
+  const double D4 = exp1*exp1*exp2*exp2;
+  const double D3 = -2*cos1*exp1*exp2*exp2 - 2*cos2*exp2*exp1*exp1;
+  const double D2 = 4*cos2*cos1*exp1*exp2 + exp1*exp1 + exp2*exp2;
+  const double D1 = -2*(exp2*cos2 + exp1*cos1);
+  const double alpha = 2*(N0 + N1 + N2 + N3)/(1 + D1 + D2 + D3 + D4) - N0;
+  const double nn[4] = { N0/alpha, N1/alpha, N2/alpha, N3/alpha };
+  const double dd[4] = { D1, D2, D3, D4 };
+  for (int k=0;k<4;k++)
+  {
+    n[k] = (float)nn[k];
+    d[k] = (float)dd[k];
+  }
+  // symmetric anti-causal part
+  m[0] = (float)(nn[1] - D1*nn[0]);
+  m[1] = (float)(nn[2] - D2*nn[0]);
+  m[2] = (float)(nn[3] - D3*nn[0]);
+  m[3] = (float)(-D4*nn[0]);
+}
+
+void RecursiveGaussian::filterAcross(float *x, const int nLines, const ptrdiff_t lineStride, const int width) const
+{
+  static const RecursiveStepFn step = selectRecursiveStep();
+  const std::vector<float> zero(width,0.0f);
+  std::vector<float> in((size_t)nLines*width);
+  for (int l=0;l<nLines;l++)
+    std::copy(x + l*lineStride,x + l*lineStride + width,&in[(size_t)l*width]);
+  auto input = [&](const int l) { return (l>=0 && l<nLines) ? &in[(size_t)l*width] : zero.data(); };
+  auto output = [&](const int l) { return (l>=0) ? x + l*lineStride : zero.data(); };
+  for (int l=0;l<nLines;l++)
+  {
+    const float *xs[4] = { input(l), input(l-1), input(l-2), input(l-3) };
+    const float *ys[4] = { output(l-1), output(l-2), output(l-3), output(l-4) };
+    step(x + l*lineStride,xs,n,ys,d,width);
+  }
+  // the anti-causal output is kept in a ring of 5 rows and added to x
+  std::vector<float> ring((size_t)5*width,0.0f);
+  auto previous = [&](const int l) { return (l<nLines) ? &ring[(size_t)(l%5)*width] : zero.data(); };
+  for (int l=nLines-1;l>=0;l--)
+  {
+    const float *xs[4] = { input(l+1), input(l+2), input(l+3), input(l+4) };
+    const float *ys[4] = { previous(l+1), previous(l+2), previous(l+3), previous(l+4) };
+    float *y = &ring[(size_t)(l%5)*width];
+    step(y,xs,m,ys,d,width);
+    float *out = x + l*lineStride;
+    for (int j=0;j<width;j++) out[j] += y[j];
+  }
+}
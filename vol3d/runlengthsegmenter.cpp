@@ -22,14 +22,16 @@
 #include <DS/runlengthsegmenter.h>
 #include <graph.h>
 #include <algorithm>
-
-int graphFactor=10;
+#include <bit>
 
 RunLengthSegmenter::RunLengthSegmenter() :
 	mode(D6),
+	labeling(UnionFindLabeling),
+	threadPool(nullptr),
 	cx(0), cy(0), cz(0),
 	high(255), low(0),
 	datasize(0),
+	labeledVoxels(0),
 	runcount(0),
 	nsymbols(0),
 	verbose(false),
@@ -52,8 +54,8 @@ void RunLengthSegmenter::setup(const int cx_, const int cy_, const int cz_)
 	high = 255;
 	low = 0;
 	runcount = 0;
-	datasize = cz * cx * cy;
-	runs.resize(datasize);
+	datasize = (size_t)cz * cx * cy;
+	runs.clear();
 	linestart.resize(cz*cy+1);
 }
 
@@ -66,21 +68,93 @@ void RunLengthSegmenter::segment(uint8 *imageIn, uint8 *imageOut, uint8 zero, ui
 	label(imageOut);
 }
 
+namespace {
+
+// Calls link(a,b) for the runs a of [a0,a1) and b of [b0,b1), two sorted lines of runs, that
+// overlap in x, or also that are adjacent in x.
+template <bool adjacent, class Link>
+inline void linkLines(const std::vector<RunLength> &runs, int a, const int a1, int b, const int b1, Link &link)
+{
+	while ((a<a1)&&(b<b1))
+	{
+		if (adjacent ? runs[a].neighbors(runs[b]) : runs[a].intersects(runs[b])) link(a,b);
+		const int stopA = runs[a].stop;
+		const int stopB = runs[b].stop;
+		if (stopA<=stopB) a++;
+		if (stopA>=stopB) b++;
+	}
+}
+
+}
+
+// Each line is linked to the line before it and to the same line of the previous slice; D18 and
+// D26 also link the previous line of the previous slice (D18 without its x-diagonals) and, apart
+// from that, D18 and D26 link runs that are adjacent in x as well as the ones that overlap.
+template <RunLengthSegmenter::Mode connectivity, class Link>
+void RunLengthSegmenter::linkRuns(Link &link, const int z, const bool withinSlice, const bool toPrevious)
+{
+	const bool adjacent = (connectivity!=D6);
+	const int *pLinestart = &linestart[0];
+// The first line of each slice (y==0) has no line before it (there are no voxels for y<0),
+// so it is only linked to the previous slice.
+	for (int y=0; y<cy; y++)
+	{
+		const int line = z*cy + y;
+		const int first = pLinestart[line];
+		const int last  = pLinestart[line+1];
+		if (last<=first) continue;					// the line is empty
+		if (toPrevious && (z>0)) // check previous slice.
+		{
+			const int up = line - cy;
+			if ((connectivity!=D6) && (y>0))
+				linkLines<connectivity==D26>(runs,pLinestart[up-1],pLinestart[up],first,last,link);
+			linkLines<adjacent>(runs,pLinestart[up],pLinestart[up+1],first,last,link);
+		}
+		if (withinSlice && (y>0))
+			linkLines<adjacent>(runs,pLinestart[line-1],first,first,last,link);
+	}
+}
+
 void RunLengthSegmenter::makeGraph()
 {
-	switch (mode)
+	auto linkSlice = [&](auto &link, const int z, const bool withinSlice, const bool toPrevious)
 	{
-		case D18 :
-			makeGraph18();
-			break;
-		case D26 :
-			makeGraph26();
-			break;
-		case D6 : 
-		default:
-			makeGraph6();
-			break;
+		switch (mode)
+		{
+			case D18 : linkRuns<D18>(link,z,withinSlice,toPrevious); break;
+			case D26 : linkRuns<D26>(link,z,withinSlice,toPrevious); break;
+			case D6 :
+			default: linkRuns<D6>(link,z,withinSlice,toPrevious); break;
+		}
+	};
+	map.resize(runcount+1);
+	newmap.resize(runcount+1);
+	if (labeling==GraphLabeling)
+	{
+		Graph graph(runcount+1);
+		graph.reset(runcount+1);
+		auto link = [&](const int a, const int b) { graph.link(a,b); graph.link(b,a); };
+		for (int z=0;z<cz;z++) linkSlice(link,z,true,true);
+		nsymbols = graph.makemap(&map[0]);
 	}
+	else
+	{
+		// the runs of a slab are contiguous, so the slabs touch separate parts of unionFind
+		unionFind.reset(runcount+1);
+		auto link = [&](const int a, const int b) { unionFind.unite(a,b); };
+		ThreadPool &threads = pool();
+		const int nSlabs = std::min(cz,(threads.size()>1) ? 4*threads.size() : 1);
+		auto slabStart = [&](const int s) { return (int)(((int64_t)cz*s)/nSlabs); };
+		threads.run(nSlabs,[&](const int s, const int /*worker*/) {
+			const int z0 = slabStart(s), z1 = slabStart(s+1);
+			for (int z=z0;z<z1;z++) linkSlice(link,z,true,z>z0);
+		});
+		for (int s=1;s<nSlabs;s++) linkSlice(link,slabStart(s),false,true);
+		nsymbols = unionFind.makemap(&map[0]);
+	}
+	if (verbose) std::cout<<"There are "<<nsymbols<<" symbols."<<std::endl;
+	population();
+	findmax();
 }
 
 void RunLengthSegmenter::encode(uint8 *buffer)
@@ -89,6 +163,7 @@ void RunLengthSegmenter::encode(uint8 *buffer)
 	int index = 0;
 	int state = 0;
 	runcount = 0;
+	runs.clear();
 	RunLength newRun;
 	int linecount = 0;
 	int *pLinestart = &linestart[0];
@@ -110,7 +185,7 @@ void RunLengthSegmenter::encode(uint8 *buffer)
 				{
 					newRun.stop = x-1;
 					state = 0;
-					runs[runcount++] = newRun;
+					runs.push_back(newRun); runcount++;
 				}
 			}
 			else
@@ -125,7 +200,7 @@ void RunLengthSegmenter::encode(uint8 *buffer)
 		if (state!=0) // terminate the code.
 		{
 			newRun.stop = cx - 1;
-			runs[runcount++] = newRun;
+			runs.push_back(newRun); runcount++;
 		}
 	}
 	pLinestart[linecount] = runcount;
@@ -135,7 +210,7 @@ int RunLengthSegmenter::presegmentBG(Vol3D<VBit> &v)
 {
 	setup(v.cx,v.cy,v.cz);
 	runcount = 0;
-	encode32BG(v.raw32());
+	encode32BG(v.raw64());
 	makeGraph();
 	return rlsPicked;
 }
@@ -146,12 +221,12 @@ int RunLengthSegmenter::presegmentFG(Vol3D<VBit> &v)
 	runcount = 0;
 	high = 255;
 	low = 0;
-	encode32FG(v.raw32());
+	encode32FG(v.raw64());
   makeGraph();
 	return rlsPicked;
 }
 
-int RunLengthSegmenter::segment32FG(unsigned int *imageIn, unsigned int *imageOut)
+int RunLengthSegmenter::segment32FG(Word *imageIn, Word *imageOut)
 {
 	runcount = 0;
 	high = 255;
@@ -162,7 +237,7 @@ int RunLengthSegmenter::segment32FG(unsigned int *imageIn, unsigned int *imageOu
 	return rlsPicked;
 }
 
-int RunLengthSegmenter::segmenttest32FG(unsigned int *imageIn, unsigned char *imageOut)
+int RunLengthSegmenter::segmenttest32FG(Word *imageIn, unsigned char *imageOut)
 {
 	runcount = 0;
 	high = 255;
@@ -173,7 +248,7 @@ int RunLengthSegmenter::segmenttest32FG(unsigned int *imageIn, unsigned char *im
 	return rlsPicked;
 }
 
-int RunLengthSegmenter::segmenttest32FG(unsigned char *imageIn,unsigned int *imageOut)
+int RunLengthSegmenter::segmenttest32FG(unsigned char *imageIn,Word *imageOut)
 {
   runcount = 0;
 	high = 255;
@@ -184,7 +259,7 @@ int RunLengthSegmenter::segmenttest32FG(unsigned char *imageIn,unsigned int *ima
 	return rlsPicked;
 }
 
-void RunLengthSegmenter::segment32BG(unsigned int *imageIn, unsigned int *imageOut)
+void RunLengthSegmenter::segment32BG(Word *imageIn, Word *imageOut)
 {
   runcount = 0;
 	encode32BG(imageIn);
@@ -192,7 +267,7 @@ void RunLengthSegmenter::segment32BG(unsigned int *imageIn, unsigned int *imageO
 	label32BG(imageOut);
 }
 
-void RunLengthSegmenter::segment32FG(uint8 *imageIn, unsigned int *imageOut)
+void RunLengthSegmenter::segment32FG(uint8 *imageIn, Word *imageOut)
 {
 	runcount = 0;
 	high = 255;
@@ -202,7 +277,7 @@ void RunLengthSegmenter::segment32FG(uint8 *imageIn, unsigned int *imageOut)
 	label32FG(imageOut);
 }
 
-void RunLengthSegmenter::segment32BG(uint8 *imageIn, unsigned int *imageOut)
+void RunLengthSegmenter::segment32BG(uint8 *imageIn, Word *imageOut)
 {
 	runcount = 0;
 	high = 0;
@@ -212,159 +287,81 @@ void RunLengthSegmenter::segment32BG(uint8 *imageIn, unsigned int *imageOut)
 	label32BG(imageOut);
 }
 
-void RunLengthSegmenter::label32FG(unsigned int *imageOut)
+namespace {
+
+// sets (or clears) the bits [start,stop] of line
+template <bool set>
+inline void paintRun(RunLengthSegmenter::Word *line, const int start, const int stop)
 {
-	remap(newmap);
-	int index = 0;
-	int label = 0;
-	int linecount = 0;
-	const int extra = (cx&0x1F);
-	const int wordsPerLine  = (cx>>5);
-	const int wx = wordsPerLine + (extra!=0); // width of x
-	const int wsize = wx * cy * cz;
-	for (int d=0;d<wsize;d++) imageOut[d] = 0;
-	int *pLinestart = &linestart[0];	
-	for (int z=0;z<cz; z++)
+	typedef RunLengthSegmenter::Word Word;
+	const Word allOnes = ~(Word)0;
+	const int w0 = start>>6;
+	const int w1 = stop>>6;
+	const Word head = allOnes<<(start&0x3F);
+	const Word tail = allOnes>>(63-(stop&0x3F));
+	auto paint = [&](Word &w, const Word mask) { if (set) w |= mask; else w &= ~mask; };
+	if (w0==w1)
 	{
-		for (int y=0; y<cy; y++)
-		{
-			const int first = pLinestart[linecount];
-			const int last  = pLinestart[++linecount];
-			for (int i=first; i<last; i++)
-			{
-				if (newmap[label]) // only need to label positives.
-				{
-					const int start = runs[i].start;
-					const int stop = runs[i].stop;
-					unsigned int *X = imageOut + index + (start>>5);
-					unsigned int val = 0;
-					int pos = start&0x1F;
-					for (int j=start; j<=stop; j++)
-					{	
-						val|=0x80000000;
-						if (((++pos) &= 0x1F)==0) { *X++ |= val; val=0;}
-						val>>=1;
-					}
-					if (pos) { *X |= (val>>(31-pos)); }
-				}
-				label++;
-			}
-			index += wx;			
-		}
-	}	
+		paint(line[w0],head&tail);
+		return;
+	}
+	paint(line[w0],head);
+	for (int w=w0+1;w<w1;w++) line[w] = set ? allOnes : 0;
+	paint(line[w1],tail);
 }
 
-void RunLengthSegmenter::label32BG(unsigned int *imageOut)
+}
+
+template <bool foreground>
+size_t RunLengthSegmenter::paintRuns(Word *imageOut)
 {
 	remap(newmap);
-	int *pLinestart = &linestart[0];
-	int index = 0;
-	int label = 0;
-	int linecount = 0;
-	const int extra = (cx&0x1F);
-	const int wordsPerLine  = (cx>>5);
-	const int wx = wordsPerLine + (extra!=0); // width of x
-	int endwidth = 32 - extra; // extra bits in the code
-	unsigned int edgecode=0xFFFFFFFF;
-	edgecode>>=endwidth;
-	int d = 0;
-	for (int z=0;z<cz;z++)
-	{
-		for (int y=0;y<cy;y++)
+	const int wpl = (cx+63)>>6;
+	const Word endMask = (cx&0x3F) ? (((Word)1<<(cx&0x3F))-1) : ~(Word)0;
+	const int *pLinestart = &linestart[0];
+	std::vector<size_t> painted(cz,0);
+	pool().run(cz,[&](const int z, const int /*worker*/) {
+		size_t n = 0;
+		for (int line=z*cy;line<(z+1)*cy;line++)
 		{
-			for (int x=0;x<wordsPerLine;x++)
+			Word *out = imageOut + (size_t)line*wpl;
+			if (foreground)
+				std::fill_n(out,wpl,0);
+			else
 			{
-				imageOut[d++] = 0xFFFFFFFF;
+				std::fill_n(out,wpl,~(Word)0);
+				out[wpl-1] = endMask;
 			}
-			if (extra>0) imageOut[d++] = edgecode;
-		}
-	}
-	for (int z=0;z<cz; z++)
-	{
-		for (int y=0; y<cy; y++)
-		{
-			int first = pLinestart[linecount];
-			int last  = pLinestart[++linecount];
-			for (int i=first; i<last; i++)
+			for (int i=pLinestart[line];i<pLinestart[line+1];i++)
 			{
-				if (newmap[label]) // only need to label positives.
-				{
-					int start = runs[i].start;
-					int stop = runs[i].stop;
-					unsigned int *X = imageOut + index + (start>>5);
-					unsigned int val = 0;
-					int pos = start&0x1F;
-					for (int j=start; j<=stop; j++)
-					{	
-						val|=0x80000000;
-						if (((++pos) &= 0x1F)==0) { *X++ ^= val; val=0;}
-						val>>=1;
-					}
-					if (pos) { *X ^= (val>>(31-pos)); }
-				}
-				label++;
+				if (!newmap[i]) continue; // only need to label positives.
+				paintRun<foreground>(out,runs[i].start,runs[i].stop);
+				n += runs[i].stop - runs[i].start + 1;
 			}
-			index += wx;			
 		}
-	}
+		painted[z] = n;
+	});
+	size_t total = 0;
+	for (int z=0;z<cz;z++) total += painted[z];
+	labeledVoxels = foreground ? total : datasize - total;
+	return labeledVoxels;
 }
 
-void RunLengthSegmenter::encode32BG(unsigned int *imageIn)
+size_t RunLengthSegmenter::label32FG(Word *imageOut)
 {
-	int state = 0;
-	runcount = 0;
-	RunLength newRun;
-	int linecount = 0;
-	int *pLinestart = &linestart[0];
-	unsigned int *cptr  = imageIn;
-	for (int z=0; z<cz; z++)
-	for (int y=0; y<cy; y++)
-	{
-		pLinestart[linecount++] = runcount;
-		unsigned int val = *(cptr++);
-		int p = 1;
-		int bit = (val & 1);
-		state = (bit==0); // grab the lowest bit
-		val >>=1;
-		if (state) newRun.start = 0;
-		for (int x=1;x<cx;x++)
-		{
-			if (p==0) { val = *(cptr++); }
-			(++p) &= 0x1F;			
-			int bit = (val & 1);		
-			if (bit!=0)
-			{
-				if (state!=0) // terminate a code
-				{
-					newRun.stop = x-1;
-					state = 0;
-					runs[runcount++] = newRun;
-				}
-			}
-			else
-			{
-				if (state==0) // start a New code
-				{
-					newRun.start = x;
-					state = 1;
-				}
-			}
-			val >>=1;  // shift the next one into place
-		}
-		if (state!=0) // terminate the code.
-		{
-			newRun.stop = cx - 1;
-			runs[runcount++] = newRun;
-		}
-	}
-	pLinestart[linecount] = runcount;
+	return paintRuns<true>(imageOut);
+}
+
+size_t RunLengthSegmenter::label32BG(Word *imageOut)
+{
+	return paintRuns<false>(imageOut);
 }
 
 void RunLengthSegmenter::label(uint8 *buffOut)
 {
 	remap(newmap);
 	int *pLinestart = &linestart[0];
-	for (int d=0;d<datasize;d++) buffOut[d] = low;
+	for (size_t d=0;d<datasize;d++) buffOut[d] = low;
 	int index = 0;
 	int label = 0;
 	int linecount = 0;
@@ -436,7 +433,7 @@ void RunLengthSegmenter::population()
 			int last  = pLinestart[++linecount];
 			for (int i=first; i<last; i++)
 			{
-				int length = (runs[i].stop - runs[i].start) + 1;
+				const sint64 length = (runs[i].stop - runs[i].start) + 1;
 				if (length>0)
 				{
 					if (map[label]<0)
@@ -465,74 +462,6 @@ void RunLengthSegmenter::population()
 	std::sort(regionInfo.begin(),regionInfo.end(),RunLengthSegmenter::regionInfoGE);
 }
 
-void RunLengthSegmenter::makeGraph6()
-{
-	std::vector<int> &pLinestart(linestart);
-  int linecount = 0;
-  Graph graph(datasize/graphFactor);
-	graph.reset(runcount+1);
-	for (int z=0;z<cz; z++)
-	{
-// Since the first line of each slice (y==0) is not connected to anything 
-// above it (there are no voxels for (y<0), there is nothing to link.
-		linecount++;
-		for (int y=1; y<cy; y++)
-		{
-			int first  = pLinestart[linecount];
-			int runA   = pLinestart[linecount-1]; // previous
-			int prevline = linecount - cy;
-			int last   = pLinestart[linecount+1];
-			linecount++;
-			if (last<=first) continue;					// the line is empty
-			if (z>0)
-			{
-				int curr = first;
-				int upStart= pLinestart[prevline]; // previous slice
-				int upStop = pLinestart[prevline+1]; // previous slice
-				int up   = upStart;
-				for (;;)
-				{
-					if (up  >=upStop) break;
-					if (curr>=last  ) break;
-					if (intersect(runs[up],runs[curr]))
-					{
-							graph.link(up  ,curr);
-              graph.link(curr,up  );
-					}
-					int newUp   = up;
-					int newCurr = curr;
-					if (runs[up].stop<=runs[curr].stop) newUp++;
-					if (runs[up].stop>=runs[curr].stop) newCurr++;
-					up   = newUp;
-					curr = newCurr;
-				}
-			}
-			int runB = first;
-			for (;;)
-			{
-				if (runA>=first) break;
-				if (runB>=last ) break;
-				if (intersect(runs[runA],runs[runB]))
-				{
-					graph.link(runA,runB);
-          graph.link(runB,runA);
-				}
-				int newA = runA;
-				int newB = runB;
-				if (runs[runA].stop<=runs[runB].stop) newA++;
-				if (runs[runA].stop>=runs[runB].stop) newB++;
-				runA = newA;
-				runB = newB;
-			}
-		}
-	}
-	map.resize(runcount+1);
-	newmap.resize(runcount+1);
-	nsymbols = graph.makemap(&map[0]);
-	population();
-	findmax();
-}
-
 void RunLengthSegmenter::findmax()
 // Find the single most populous label
 // Can check if centroid of object is near the center of image
@@ -590,252 +519,98 @@ int RunLengthSegmenter::findRegion(const int x, const int y, const int z)
 	return term;
 }
 
-void RunLengthSegmenter::makeGraph26()
+namespace {
+
+// the bits of word w of a line that belong to runs, up to the end of the line
+template <bool foreground>
+inline RunLengthSegmenter::Word runBits(const RunLengthSegmenter::Word *line, const int w, const int wpl, const RunLengthSegmenter::Word endMask)
 {
-	int linecount = 0;
-	int linkcount = 0;
-  Graph graph(datasize/graphFactor);
-	graph.reset(runcount+1);
-	std::vector<int> &pLinestart(linestart);
-	for (int z=0;z<cz; z++)
-	{
-// Since the first line of each slice (y==0) is not connected to anything 
-// above it (there are no voxels for (y<0), there is nothing to link.
-		linecount++;
-		for (int y=1; y<cy; y++)
-		{
-			int first  = pLinestart[linecount];
-			int runA   = pLinestart[linecount-1]; // previous
-			int prevline = linecount - cy;
-			int last   = pLinestart[linecount+1];
-			linecount++;
-			if (last<=first) continue;					// the line is empty
-			if (z>0) // check previous slice.
-			{
-				int curr = first;
-				{
-					int upStart= pLinestart[prevline-1]; // previous slice
-					int upStop = pLinestart[prevline  ]; // previous slice
-					int up   = upStart;
-					for (;;)
-					{
-						if (up  >=upStop) break;
-						if (curr>=last  ) break;
-						if (runs[up].neighbors(runs[curr]))
-						{
-								graph.link(up  ,curr);
-								graph.link(curr,up  );
-							linkcount++;
-						}
-						int newUp   = up;
-						int newCurr = curr;
-						if (runs[up].stop<=runs[curr].stop) newUp++;
-						if (runs[up].stop>=runs[curr].stop) newCurr++;
-						up   = newUp;
-						curr = newCurr;
-					}
-				}
-				curr = first;
-				{
-					int upStart= pLinestart[prevline]; // previous slice
-					int upStop = pLinestart[prevline+1]; // previous slice
-					int up   = upStart;
-					for (;;)
-					{
-						if (up  >=upStop) break;
-						if (curr>=last  ) break;
-						if (runs[up].neighbors(runs[curr]))
-						{
-								graph.link(up  ,curr);
-								graph.link(curr,up  );
-							linkcount++;
-						}
-						int newUp   = up;
-						int newCurr = curr;
-						if (runs[up].stop<=runs[curr].stop) newUp++;
-						if (runs[up].stop>=runs[curr].stop) newCurr++;
-						up   = newUp;
-						curr = newCurr;
-					}
-				}
-			}
-			int runB = first;
-			for (;;)
-			{
-				if (runA>=first) break;
-				if (runB>=last ) break;
-				if (runs[runA].neighbors(runs[runB]))
-				{
-					graph.link(runA,runB);
-					graph.link(runB,runA);
-					linkcount++;
-				}
-				int newA = runA;
-				int newB = runB;
-				if (runs[runA].stop<=runs[runB].stop) newA++;
-				if (runs[runA].stop>=runs[runB].stop) newB++;
-				runA = newA;
-				runB = newB;
-			}
-		}
-	}
-	map.resize(runcount+1);
-	newmap.resize(runcount+1);
-	nsymbols = graph.makemap(&map[0]);
-	if (verbose) std::cout<<"There are "<<nsymbols<<" symbols."<<std::endl;
-	population();
-	findmax();
+	const RunLengthSegmenter::Word bits = foreground ? line[w] : ~line[w];
+	return (w==wpl-1) ? (bits & endMask) : bits;
 }
 
-void RunLengthSegmenter::makeGraph18()
-{
-	int linecount = 0;
-	int linkcount = 0;
-  Graph graph(datasize/graphFactor);
-	graph.reset(runcount+1);
-	std::vector<int> &pLinestart(linestart);
-	for (int z=0;z<cz; z++)
-	{
-// Since the first line of each slice (y==0) is not connected to anything 
-// above it (there are no voxels for (y<0), there is nothing to link.
-		linecount++;
-		for (int y=1; y<cy; y++)
-		{
-			int first  = pLinestart[linecount];
-			int runA   = pLinestart[linecount-1]; // previous
-			int prevline = linecount - cy;
-			int last   = pLinestart[linecount+1];
-			linecount++;
-			if (last<=first) continue;					// the line is empty
-			if (z>0) // check previous slice.
-			{
-				int curr = first;
-				{
-					int upStart= pLinestart[prevline-1]; // previous slice
-					int upStop = pLinestart[prevline  ]; // previous slice
-					int up   = upStart;
-					for (;;)
-					{
-						if (up  >=upStop) break;
-						if (curr>=last  ) break;
-						if (runs[up].intersects(runs[curr]))
-						{
-								graph.link(up  ,curr);
-								graph.link(curr,up  );
-							linkcount++;
-						}
-						int newUp   = up;
-						int newCurr = curr;
-						if (runs[up].stop<=runs[curr].stop) newUp++;
-						if (runs[up].stop>=runs[curr].stop) newCurr++;
-						up   = newUp;
-						curr = newCurr;
-					}
-				}
-				curr = first;
-				{
-					int upStart= pLinestart[prevline]; // previous slice
-					int upStop = pLinestart[prevline+1]; // previous slice
-					int up   = upStart;
-					for (;;)
-					{
-						if (up  >=upStop) break;
-						if (curr>=last  ) break;
-						if (runs[up].neighbors(runs[curr]))
-						{
-								graph.link(up  ,curr);
-								graph.link(curr,up  );
-							linkcount++;
-						}
-						int newUp   = up;
-						int newCurr = curr;
-						if (runs[up].stop<=runs[curr].stop) newUp++;
-						if (runs[up].stop>=runs[curr].stop) newCurr++;
-						up   = newUp;
-						curr = newCurr;
-					}
-				}
-			}
-			int runB = first;
-			for (;;)
-			{
-				if (runA>=first) break;
-				if (runB>=last ) break;
-				if (runs[runA].neighbors(runs[runB]))
-				{
-					graph.link(runA,runB);
-					graph.link(runB,runA);
-					linkcount++;
-				}
-				int newA = runA;
-				int newB = runB;
-				if (runs[runA].stop<=runs[runB].stop) newA++;
-				if (runs[runA].stop>=runs[runB].stop) newB++;
-				runA = newA;
-				runB = newB;
-			}
-		}
-	}
-	map.resize(runcount+1);
-	newmap.resize(runcount+1);
-	nsymbols = graph.makemap(&map[0]);
-	if (verbose) std::cout<<"There are "<<nsymbols<<" symbols."<<std::endl;
-	population();
-	findmax();
 }
 
-void RunLengthSegmenter::encode32FG(unsigned int *imageIn)
+template <bool foreground>
+void RunLengthSegmenter::encodeWords(const Word *imageIn)
 {
-	const uint8 code=high;
-	int state = 0;
-	runcount = 0;
-	RunLength newRun;
-	int linecount = 0;
-	unsigned int *cptr = imageIn;
-	std::vector<int> &pLinestart(linestart);
-	for (int z=0; z<cz; z++)
-	{
-		for (int y=0; y<cy; y++)
+	const int wpl = (cx+63)>>6;
+	const Word endMask = (cx&0x3F) ? (((Word)1<<(cx&0x3F))-1) : ~(Word)0;
+	const Word allOnes = ~(Word)0;
+	const int nLines = cy*cz;
+	int *pLinestart = &linestart[0];
+	ThreadPool &threads = pool();
+	// a run starts at each bit that is set when the bit before it is not
+	threads.run(cz,[&](const int z, const int /*worker*/) {
+		for (int line=z*cy;line<(z+1)*cy;line++)
 		{
-			pLinestart[linecount++] = runcount;
-			state = (*cptr)&1;		// equiv to (imageIn[index]==code);
-			if (state)
+			const Word *src = imageIn + (size_t)line*wpl;
+			int count = 0;
+			Word carry = 0;
+			for (int w=0;w<wpl;w++)
 			{
-				newRun.start = 0;
+				const Word bits = runBits<foreground>(src,w,wpl,endMask);
+				count += std::popcount(bits & ~((bits<<1)|carry));
+				carry = bits>>63;
 			}
-			unsigned int val=0;
-			int p = 0;
-			for (int x=0;x<cx;x++)
+			pLinestart[line+1] = count;
+		}
+	});
+	pLinestart[0] = 0;
+	for (int line=0;line<nLines;line++) pLinestart[line+1] += pLinestart[line];
+	runcount = pLinestart[nLines];
+	runs.resize(runcount);
+	threads.run(cz,[&](const int z, const int /*worker*/) {
+		for (int line=z*cy;line<(z+1)*cy;line++)
+		{
+			const Word *src = imageIn + (size_t)line*wpl;
+			RunLength *run = &runs[0] + pLinestart[line];
+			int start = -1; // start of a run that continues into the next word
+			for (int w=0;w<wpl;w++)
 			{
-				if (p==0) { val = *(cptr++); }
-				(++p) &= 0x1F;
-        uint8 lowbit = 0xFF * (val & 1);	// grab the lowest bit
-				val >>=1;													// shift the next one into place				
-				if (x==0) continue;
-        if (lowbit!=code)
+				Word bits = runBits<foreground>(src,w,wpl,endMask);
+				const int base = w<<6;
+				if (start>=0)
 				{
-					if (state!=0) // terminate a code
-					{
-						newRun.stop = x-1;
-						state = 0;
-						runs[runcount++] = newRun;
-					}
+					if (bits==allOnes) continue;
+					const int end = std::countr_zero(~bits);
+					run->start = start;
+					run->stop = base + end - 1;
+					run++;
+					start = -1;
+					bits &= allOnes<<end;
 				}
-				else
+				while (bits)
 				{
-					if (state==0) // start a New code
+					const int first = std::countr_zero(bits);
+					const Word rest = ~bits & (allOnes<<first);
+					if (!rest)
 					{
-						newRun.start = x;
-						state = 1;
+						start = base + first;
+						break;
 					}
+					const int end = std::countr_zero(rest);
+					run->start = base + first;
+					run->stop = base + end - 1;
+					run++;
+					bits &= allOnes<<end;
 				}
 			}
-			if (state!=0) // terminate the code.
+			if (start>=0)
 			{
-				newRun.stop = cx - 1;
-				runs[runcount++] = newRun;
+				run->start = start;
+				run->stop = cx - 1;
 			}
 		}
-	}
-	pLinestart[linecount] = runcount;
+	});
+}
+
+void RunLengthSegmenter::encode32FG(Word *imageIn)
+{
+	encodeWords<true>(imageIn);
+}
+
+void RunLengthSegmenter::encode32BG(Word *imageIn)
+{
+	encodeWords<false>(imageIn);
 }
@@ -0,0 +1,141 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+
+#include <separableconvolution.h>
+#include <cpufeatures.h>
+
+namespace {
+
+CPU_INLINE void acrossRowsBody(float * __restrict out, const float *const *rows, const float *h, const int r, const int n,
+                               const bool accumulate)
+{
+  const float * __restrict c = rows[r];
+  const float h0 = h[0];
+  if (accumulate)
+    for (int j=0;j<n;j++) out[j] += h0*c[j];
+  else
+    for (int j=0;j<n;j++) out[j] = h0*c[j];
+  for (int m=1;m<=r;m++)
+  {
+    const float * __restrict a = rows[r-m];
+    const float * __restrict b = rows[r+m];
+    const float hm = h[m];
+    for (int j=0;j<n;j++) out[j] += hm*(a[j]+b[j]);
+  }
+}
+
+CPU_INLINE void alongRowBody(float * __restrict out, const float * __restrict in, const float *h, const int r, const int n,
+                             const bool accumulate)
+{
+  const float h0 = h[0];
+  if (accumulate)
+    for (int j=0;j<n;j++) out[j] += h0*in[j];
+  else
+    for (int j=0;j<n;j++) out[j] = h0*in[j];
+  for (int m=1;m<=r;m++)
+  {
+    const float hm = h[m];
+    for (int j=0;j<n;j++) out[j] += hm*(in[j-m]+in[j+m]);
+  }
+}
+
+typedef void (*AcrossRowsFn)(float *, const float *const *, const float *, const int, const int, const bool);
+typedef void (*AlongRowFn)(float *, const float *, const float *, const int, const int, const bool);
+
+void acrossRowsScalar(float *out, const float *const *rows, const float *h, const int r, const int n, const bool accumulate)
+{
+  acrossRowsBody(out,rows,h,r,n,accumulate);
+}
+
+void alongRowScalar(float *out, const float *in, const float *h, const int r, const int n, const bool accumulate)
+{
+  alongRowBody(out,in,h,r,n,accumulate);
+}
+
+#if CPU_TARGET_SUPPORTED
+CPU_TARGET_AVX512 void acrossRowsAVX512(float *out, const float *const *rows, const float *h, const int r, const int n,
+                                        const bool accumulate)
+{
+  acrossRowsBody(out,rows,h,r,n,accumulate);
+}
+
+CPU_TARGET_AVX512 void alongRowAVX512(float *out, const float *in, const float *h, const int r, const int n, const bool accumulate)
+{
+  alongRowBody(out,in,h,r,n,accumulate);
+}
+
+CPU_TARGET_AVX2 void acrossRowsAVX2(float *out, const float *const *rows, const float *h, const int r, const int n,
+                                    const bool accumulate)
+{
+  acrossRowsBody(out,rows,h,r,n,accumulate);
+}
+
+CPU_TARGET_AVX2 void alongRowAVX2(float *out, const float *in, const float *h, const int r, const int n, const bool accumulate)
+{
+  alongRowBody(out,in,h,r,n,accumulate);
+}
+#endif
+
+AcrossRowsFn selectAcrossRows()
+{
+#if CPU_TARGET_SUPPORTED
+  if (CPUFeatures::hasAVX512()) return acrossRowsAVX512;
+  if (CPUFeatures::hasAVX2()) return acrossRowsAVX2;
+#endif
+  return acrossRowsScalar;
+}
+
+AlongRowFn selectAlongRow()
+{
+#if CPU_TARGET_SUPPORTED
+  if (CPUFeatures::hasAVX512()) return alongRowAVX512;
+  if (CPUFeatures::hasAVX2()) return alongRowAVX2;
+#endif
+  return alongRowScalar;
+}
+
+}
+
+void SeparableConvolution::acrossRows(float *out, const float *const *rows, const float *h, const int r, const int n,
+                                      const bool accumulate)
+{
+  static const AcrossRowsFn fn = selectAcrossRows();
+  fn(out,rows,h,r,n,accumulate);
+}
+
+void SeparableConvolution::alongRow(float *out, const float *in, const float *h, const int r, const int n, const bool accumulate)
+{
+  static const AlongRowFn fn = selectAlongRow();
+  fn(out,in,h,r,n,accumulate);
+}
+
+std::vector<float> SeparableConvolution::fold(const std::vector<double> &kernel)
+{
+  const int r = (int)kernel.size()/2;
+  std::vector<float> h(r+1);
+  for (int m=0;m<=r;m++) h[m] = (float)kernel[r+m];
+  return h;
+}
+
+const char *SeparableConvolution::instructionSetName()
+{
+  return CPUFeatures::bestName();
+}
@@ -0,0 +1,510 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <iostream>
+#include <DS/sparsebitvolume.h>
+#include <cpufeatures.h>
+
+typedef SparseBitVolume::Word Word;
+
+namespace {
+
+const Word zeroBrick[SparseBitVolume::brickWords] = {};
+
+// Lines y-1..y+brickLines and slices z-1..z+brickSlices around a brick, taken from its 27
+// neighbors (dx + 3*dy + 9*dz + 13).
+const int blockLines = SparseBitVolume::brickLines + 2;
+const int blockSlices = SparseBitVolume::brickSlices + 2;
+
+// copies the block around the brick of the column dx of the neighbors into b
+CPU_INLINE void gatherBlock(const Word *const *neighbors, const int dx, Word (&b)[blockSlices][blockLines])
+{
+  const int BL = SparseBitVolume::brickLines, BS = SparseBitVolume::brickSlices;
+  for (int zz=0;zz<blockSlices;zz++)
+  {
+    const int dz = (zz==0) ? -1 : (zz==blockSlices-1) ? 1 : 0;
+    const int lz = (zz==0) ? BS-1 : (zz==blockSlices-1) ? 0 : zz-1;
+    const Word *const *n = neighbors + 13 + 9*dz + dx;
+    b[zz][0] = n[-3][lz*BL + BL-1];
+    for (int ly=0;ly<BL;ly++) b[zz][ly+1] = n[0][lz*BL + ly];
+    b[zz][blockLines-1] = n[3][lz*BL];
+  }
+}
+
+template <bool dilate>
+CPU_INLINE Word op3(const Word a, const Word b, const Word c) { return dilate ? (a|b|c) : (a&b&c); }
+
+// One step of a brick into out. mask limits the last word of each line, and only the first
+// nLines lines of the first nSlices slices are in the volume.
+template <bool dilate, bool cube>
+CPU_INLINE void stepBrick(const Word *const *neighbors, Word *out, const Word mask, const int nLines, const int nSlices)
+{
+  const int BL = SparseBitVolume::brickLines, BS = SparseBitVolume::brickSlices;
+  Word c[blockSlices][blockLines], l[blockSlices][blockLines], r[blockSlices][blockLines];
+  Word xp[blockSlices][blockLines];
+  gatherBlock(neighbors,0,c);
+  gatherBlock(neighbors,-1,l);
+  gatherBlock(neighbors,1,r);
+  for (int zz=0;zz<blockSlices;zz++)
+    for (int yy=0;yy<blockLines;yy++)
+    {
+      const Word w = c[zz][yy];
+      xp[zz][yy] = mask & (dilate ? (w | (w<<1) | (w>>1) | (l[zz][yy]>>63) | (r[zz][yy]<<63))
+                                  : (w & ((l[zz][yy]>>63)|(w<<1)) & ((w>>1)|(r[zz][yy]<<63))));
+    }
+  Word result[BS][BL];
+  if (cube)
+  {
+    Word yp[blockSlices][BL];
+    for (int zz=0;zz<blockSlices;zz++)
+      for (int ly=0;ly<BL;ly++) yp[zz][ly] = op3<dilate>(xp[zz][ly],xp[zz][ly+1],xp[zz][ly+2]);
+    for (int lz=0;lz<BS;lz++)
+      for (int ly=0;ly<BL;ly++) result[lz][ly] = op3<dilate>(yp[lz][ly],yp[lz+1][ly],yp[lz+2][ly]);
+  }
+  else
+  {
+    for (int lz=0;lz<BS;lz++)
+      for (int ly=0;ly<BL;ly++)
+      {
+        const int zz = lz+1, yy = ly+1;
+        result[lz][ly] = op3<dilate>(op3<dilate>(xp[zz][yy],c[zz][yy-1],c[zz][yy+1]),c[zz-1][yy],c[zz+1][yy]);
+      }
+  }
+  for (int lz=0;lz<BS;lz++)
+    for (int ly=0;ly<BL;ly++) out[lz*BL + ly] = (ly<nLines && lz<nSlices) ? result[lz][ly] : 0;
+}
+
+template <bool dilate, bool cube>
+CPU_TARGET_AVX2 void stepBrickAVX2(const Word *const *neighbors, Word *out, const Word mask, const int nLines, const int nSlices)
+{
+  stepBrick<dilate,cube>(neighbors,out,mask,nLines,nSlices);
+}
+
+template <bool dilate, bool cube>
+void stepBrickScalar(const Word *const *neighbors, Word *out, const Word mask, const int nLines, const int nSlices)
+{
+  stepBrick<dilate,cube>(neighbors,out,mask,nLines,nSlices);
+}
+
+typedef void (*StepKernel)(const Word *const *neighbors, Word *out, const Word mask, const int nLines, const int nSlices);
+
+template <bool dilate, bool cube>
+StepKernel selectStep()
+{
+  return CPUFeatures::hasAVX2() ? stepBrickAVX2<dilate,cube> : stepBrickScalar<dilate,cube>;
+}
+
+bool isEmpty(const Word *w)
+{
+  for (int i=0;i<SparseBitVolume::brickWords;i++) if (w[i]) return false;
+  return true;
+}
+
+}
+
+SparseBitVolume::SparseBitVolume() : threadPool(nullptr), cx(0), cy(0), cz(0), bx(0), by(0), bz(0), wpl(0), lastMask(~(Word)0),
+  lineEndMask(~(Word)0)
+{
+}
+
+bool SparseBitVolume::setsize(const int cx_, const int cy_, const int cz_)
+{
+  if (cx_<0 || cy_<0 || cz_<0) return false;
+  cx = cx_;
+  cy = cy_;
+  cz = cz_;
+  wpl = (int)VBit::wordsPerLine(cx);
+  const int extra = (cx&0x3F);
+  lastMask = (extra>0 && extra<=32) ? (Word)0xFFFFFFFF : ~(Word)0;
+  lineEndMask = (extra>0) ? (((Word)1<<extra) - 1) : ~(Word)0;
+  bx = wpl;
+  by = (cy + brickLines - 1)/brickLines;
+  bz = (cz + brickSlices - 1)/brickSlices;
+  index.assign((size_t)(bx+2)*(by+2)*(bz+2),-1);
+  bricks.clear();
+  words.clear();
+  return true;
+}
+
+void SparseBitVolume::clear()
+{
+  for (const size_t id : bricks) index[id] = -1;
+  bricks.clear();
+  words.clear();
+}
+
+// Keeps the non-empty bricks of data, compacting it in place.
+void SparseBitVolume::setBricks(const std::vector<size_t> &ids, std::vector<Word> &data)
+{
+  for (const size_t id : bricks) index[id] = -1;
+  bricks.clear();
+  size_t n = 0;
+  for (size_t i=0;i<ids.size();i++)
+  {
+    const Word *w = &data[i*brickWords];
+    if (isEmpty(w)) continue;
+    if (n!=i) std::copy_n(w,brickWords,&data[n*brickWords]);
+    index[ids[i]] = (sint32)n;
+    bricks.push_back(ids[i]);
+    n++;
+  }
+  data.resize(n*brickWords);
+  words.swap(data);
+  spare.swap(data); // the old words, kept for their storage
+}
+
+bool SparseBitVolume::encode(const Vol3D<VBit> &v)
+{
+  if (!setsize(v.cx,v.cy,v.cz)) return false;
+  const Word *src = v.craw64();
+  const size_t slicesize = (size_t)wpl*cy;
+  // each slab of bricks is gathered separately, then the slabs are appended in order
+  std::vector<std::vector<size_t>> slabIDs(bz);
+  std::vector<std::vector<Word>> slabWords(bz);
+  pool().run(bz,[&](const int bzi, const int /*worker*/) {
+    Word w[brickWords];
+    for (int byi=0;byi<by;byi++)
+      for (int bxi=0;bxi<bx;bxi++)
+      {
+        std::fill_n(w,brickWords,0);
+        bool any = false;
+        for (int lz=0;lz<brickSlices;lz++)
+        {
+          const int z = bzi*brickSlices + lz;
+          if (z>=cz) break;
+          for (int ly=0;ly<brickLines;ly++)
+          {
+            const int y = byi*brickLines + ly;
+            if (y>=cy) break;
+            w[lz*brickLines + ly] = src[slicesize*z + (size_t)y*wpl + bxi];
+            any |= (w[lz*brickLines + ly]!=0);
+          }
+        }
+        if (!any) continue;
+        slabIDs[bzi].push_back(brickID(bxi,byi,bzi));
+        slabWords[bzi].insert(slabWords[bzi].end(),w,w + brickWords);
+      }
+  });
+  for (int bzi=0;bzi<bz;bzi++)
+  {
+    for (const size_t id : slabIDs[bzi])
+    {
+      index[id] = (sint32)bricks.size();
+      bricks.push_back(id);
+    }
+    words.insert(words.end(),slabWords[bzi].begin(),slabWords[bzi].end());
+  }
+  return true;
+}
+
+bool SparseBitVolume::decode(Vol3D<VBit> &v) const
+{
+  if (((int)v.cx!=cx)||((int)v.cy!=cy)||((int)v.cz!=cz))
+    if (!v.setsize(cx,cy,cz)) return false;
+  Word *dst = v.raw64();
+  const size_t slicesize = (size_t)wpl*cy;
+  pool().run(bz,[&](const int bzi, const int /*worker*/) {
+    const int z0 = bzi*brickSlices;
+    const int z1 = std::min(z0 + brickSlices,cz);
+    std::fill(dst + slicesize*z0,dst + slicesize*z1,0);
+    const size_t first = std::lower_bound(bricks.begin(),bricks.end(),brickID(0,0,bzi)) - bricks.begin();
+    const size_t slabEnd = brickID(0,0,bzi+1);
+    for (size_t slot=first;slot<bricks.size() && bricks[slot]<slabEnd;slot++)
+    {
+      int bxi, byi, bzi_;
+      brickCoords(bricks[slot],bxi,byi,bzi_);
+      const Word *w = &words[slot*brickWords];
+      for (int z=z0;z<z1;z++)
+        for (int ly=0;ly<brickLines;ly++)
+        {
+          const int y = byi*brickLines + ly;
+          if (y>=cy) break;
+          dst[slicesize*z + (size_t)y*wpl + bxi] = w[(z-z0)*brickLines + ly];
+        }
+    }
+  });
+  return true;
+}
+
+size_t SparseBitVolume::count() const
+{
+  size_t n = 0;
+  for (size_t slot=0;slot<bricks.size();slot++)
+  {
+    int bxi, byi, bzi;
+    brickCoords(bricks[slot],bxi,byi,bzi);
+    const Word mask = (bxi==bx-1) ? lineEndMask : ~(Word)0;
+    for (int k=0;k<brickWords;k++) n += std::popcount(words[slot*brickWords + k] & mask);
+  }
+  return n;
+}
+
+// Each brick is computed from the block of lines around it, one line wider on each side in y and
+// z, taken from the 27 bricks that surround it; the bricks before and after it in x only supply
+// the carries. Dilation may reach the empty bricks next to the occupied ones, and erosion only
+// keeps bits in occupied bricks. Bricks that are full stay full under dilation, as do those
+// whose neighbors are all full under erosion, and are copied.
+void SparseBitVolume::step(const bool dilate, const bool cube)
+{
+  if (bricks.empty()) return;
+  // offsets of the 27 neighbors in the index, dx + 3*dy + 9*dz + 13
+  const ptrdiff_t px = bx+2, pxy = (ptrdiff_t)(bx+2)*(by+2);
+  ptrdiff_t offset[27];
+  for (int dz=-1;dz<=1;dz++)
+    for (int dy=-1;dy<=1;dy++)
+      for (int dx=-1;dx<=1;dx++) offset[(dz+1)*9 + (dy+1)*3 + dx+1] = dz*pxy + dy*px + dx;
+  std::vector<size_t> ids;
+  if (dilate)
+  {
+    std::vector<uint8> reached(index.size(),0);
+    for (const size_t id : bricks)
+      for (int k=0;k<27;k++) reached[id + offset[k]] = 1;
+    for (int bzi=0;bzi<bz;bzi++)
+      for (int byi=0;byi<by;byi++)
+        for (size_t id=brickID(0,byi,bzi), end=id+bx;id<end;id++)
+          if (reached[id]) ids.push_back(id);
+  }
+  else
+    ids = bricks;
+  // the neighbors that the step reads, besides the carries in x
+  std::vector<int> reads;
+  for (int k=0;k<27;k++)
+  {
+    const int dx = k%3-1, dy = (k/3)%3-1, dz = k/9-1;
+    if (dilate ? (k==13) : (cube || std::abs(dx)+std::abs(dy)+std::abs(dz)<=1)) reads.push_back(k);
+  }
+  std::vector<uint8> full(bricks.size());
+  for (size_t slot=0;slot<bricks.size();slot++)
+  {
+    int bxi, byi, bzi;
+    brickCoords(bricks[slot],bxi,byi,bzi);
+    const Word mask = (bxi==bx-1) ? lastMask : ~(Word)0;
+    const Word *w = &words[slot*brickWords];
+    bool isFull = (byi<by-1 || cy%brickLines==0) && (bzi<bz-1 || cz%brickSlices==0);
+    for (int k=0;k<brickWords && isFull;k++) isFull = (w[k]==mask);
+    full[slot] = isFull;
+  }
+  const StepKernel kernel = dilate ? (cube ? selectStep<true,true>() : selectStep<true,false>())
+                                   : (cube ? selectStep<false,true>() : selectStep<false,false>());
+  std::vector<Word> result;
+  result.swap(spare);
+  result.resize(ids.size()*brickWords);
+  const int chunk = 256;
+  const int nChunks = (int)((ids.size() + chunk - 1)/chunk);
+  pool().run(nChunks,[&](const int c, const int /*worker*/) {
+    const size_t last = std::min(ids.size(),(size_t)(c+1)*chunk);
+    for (size_t i=(size_t)c*chunk;i<last;i++)
+    {
+      const size_t id = ids[i];
+      const Word *neighbors[27];
+      for (int k=0;k<27;k++)
+      {
+        const sint32 slot = index[id + offset[k]];
+        neighbors[k] = (slot<0) ? zeroBrick : &words[(size_t)slot*brickWords];
+      }
+      bool allFull = true;
+      for (const int k : reads)
+      {
+        const sint32 slot = index[id + offset[k]];
+        if (slot<0 || !full[slot]) { allFull = false; break; }
+      }
+      Word *out = &result[i*brickWords];
+      if (allFull)
+        std::copy_n(neighbors[13],brickWords,out);
+      else
+      {
+        int bxi, byi, bzi;
+        brickCoords(id,bxi,byi,bzi);
+        kernel(neighbors,out,(bxi==bx-1) ? lastMask : ~(Word)0,
+               std::min(brickLines,cy - byi*brickLines),std::min(brickSlices,cz - bzi*brickSlices));
+      }
+    }
+  });
+  setBricks(ids,result);
+}
+
+bool SparseBitVolume::applySequence(const std::string &steps, const bool dilate)
+{
+  for (const char c : steps)
+  {
+    if (c!='D' && c!='C')
+    {
+      std::cerr<<"SparseBitVolume: unknown step '"<<c<<"' in sequence "<<steps<<std::endl;
+      return false;
+    }
+  }
+  for (const char c : steps) step(dilate,c=='C');
+  return true;
+}
+
+// Merges the sorted brick lists of the two volumes. Bricks found in only one of them are kept
+// if keepUnmatched (from this volume) or addUnmatched (from s) is set, combined with an empty
+// brick.
+template <class Op>
+bool SparseBitVolume::combine(const SparseBitVolume &s, const bool keepUnmatched, const bool addUnmatched, Op op)
+{
+  if (s.cx!=cx || s.cy!=cy || s.cz!=cz)
+  {
+    std::cerr<<"SparseBitVolume: volume dimensions do not match"<<std::endl;
+    return false;
+  }
+  std::vector<size_t> ids;
+  std::vector<Word> result;
+  result.swap(spare);
+  result.clear();
+  auto append = [&](const size_t id, const Word *a, const Word *b) {
+    ids.push_back(id);
+    for (int k=0;k<brickWords;k++) result.push_back(op(a[k],b[k]));
+  };
+  size_t i=0, j=0;
+  while (i<bricks.size() || j<s.bricks.size())
+  {
+    const size_t a = (i<bricks.size()) ? bricks[i] : index.size();
+    const size_t b = (j<s.bricks.size()) ? s.bricks[j] : index.size();
+    if (a==b)
+      append(a,&words[(i++)*brickWords],&s.words[(j++)*brickWords]);
+    else if (a<b)
+    {
+      if (keepUnmatched) append(a,&words[i*brickWords],zeroBrick);
+      i++;
+    }
+    else
+    {
+      if (addUnmatched) append(b,zeroBrick,&s.words[j*brickWords]);
+      j++;
+    }
+  }
+  setBricks(ids,result);
+  return true;
+}
+
+bool SparseBitVolume::intersect(const SparseBitVolume &s)
+{
+  return combine(s,false,false,[](const Word a, const Word b) { return a & b; });
+}
+
+bool SparseBitVolume::unite(const SparseBitVolume &s)
+{
+  return combine(s,true,true,[](const Word a, const Word b) { return a | b; });
+}
+
+bool SparseBitVolume::subtract(const SparseBitVolume &s)
+{
+  return combine(s,true,false,[](const Word a, const Word b) { return a & ~b; });
+}
+
+// Labels the runs of set bits in each word with a union-find forest. Runs are joined to the
+// runs they touch in the word before them in x (across the word boundary) and in the words of
+// the lines before them in y and z. When several components have the largest size, the one
+// whose first run is stored first is kept.
+size_t SparseBitVolume::selectLargestComponent()
+{
+  const size_t nWords = words.size();
+  for (size_t slot=0;slot<bricks.size();slot++)
+  {
+    int bxi, byi, bzi;
+    brickCoords(bricks[slot],bxi,byi,bzi);
+    if (bxi==bx-1)
+      for (int k=0;k<brickWords;k++) words[slot*brickWords + k] &= lineEndMask;
+  }
+  std::vector<uint32> runStart(nWords+1);
+  std::vector<Word> runs;
+  for (size_t k=0;k<nWords;k++)
+  {
+    runStart[k] = (uint32)runs.size();
+    Word w = words[k];
+    while (w)
+    {
+      const Word run = w & ~(w + (w & (~w + 1))); // lowest run of set bits
+      runs.push_back(run);
+      w &= ~run;
+    }
+  }
+  runStart[nWords] = (uint32)runs.size();
+  if (runs.empty()) return 0;
+  std::vector<uint32> parent(runs.size());
+  for (size_t r=0;r<runs.size();r++) parent[r] = (uint32)r;
+  auto find = [&](uint32 r) {
+    while (parent[r]!=r)
+    {
+      parent[r] = parent[parent[r]];
+      r = parent[r];
+    }
+    return r;
+  };
+  auto join = [&](const uint32 a, const uint32 b) {
+    const uint32 ra = find(a), rb = find(b);
+    if (ra<rb) parent[rb] = ra;
+    else if (rb<ra) parent[ra] = rb;
+  };
+  // joins the overlapping runs of two words; the run that ends first cannot overlap later runs
+  auto link = [&](const size_t wa, const size_t wb) {
+    uint32 i = runStart[wa], j = runStart[wb];
+    const uint32 ie = runStart[wa+1], je = runStart[wb+1];
+    while (i<ie && j<je)
+    {
+      if (runs[i]&runs[j]) join(i,j);
+      if (runs[i]<runs[j]) i++; else j++;
+    }
+  };
+  // word k of the brick at id, or nWords if the brick is empty
+  auto wordIndex = [&](const size_t id, const int k) -> size_t {
+    const sint32 slot = index[id];
+    return (slot<0) ? nWords : (size_t)slot*brickWords + k;
+  };
+  const size_t px = bx+2, pxy = (size_t)(bx+2)*(by+2);
+  for (size_t slot=0;slot<bricks.size();slot++)
+  {
+    const size_t id = bricks[slot];
+    for (int k=0;k<brickWords;k++)
+    {
+      const size_t wi = slot*brickWords + k;
+      if (runStart[wi]==runStart[wi+1]) continue;
+      const int ly = k%brickLines, lz = k/brickLines;
+      if (words[wi]&1)
+      {
+        const size_t left = wordIndex(id-1,k);
+        if (left<nWords && (words[left]>>63)) join(runStart[wi],runStart[left+1]-1);
+      }
+      const size_t below = (ly>0) ? wi-1 : wordIndex(id-px,k+brickLines-1);
+      if (below<nWords) link(wi,below);
+      const size_t before = (lz>0) ? wi-brickLines : wordIndex(id-pxy,k+(brickSlices-1)*brickLines);
+      if (before<nWords) link(wi,before);
+    }
+  }
+  std::vector<size_t> size(runs.size(),0);
+  for (size_t r=0;r<runs.size();r++) size[find((uint32)r)] += std::popcount(runs[r]);
+  uint32 best = 0;
+  for (size_t r=0;r<runs.size();r++) if (size[r]>size[best]) best = (uint32)r;
+  for (size_t k=0;k<nWords;k++)
+  {
+    Word w = 0;
+    for (uint32 r=runStart[k];r<runStart[k+1];r++) if (find(r)==best) w |= runs[r];
+    words[k] = w;
+  }
+  std::vector<size_t> ids(bricks);
+  std::vector<Word> result;
+  result.swap(words);
+  setBricks(ids,result);
+  return size[best];
+}
@@ -0,0 +1,109 @@
+// Copyright (C) 2025 The Regents of the University of California
+//
+// Created by David W. Shattuck, Ph.D.
+//
+// This file is part of MouseBSE.
+//
+// MouseBSE is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation, version 2.1.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+//
+
+#include <DS/threadpool.h>
+
+int ThreadPool::defaultThreads = 0;
+
+namespace {
+thread_local bool insidePoolTask = false;
+}
+
+int ThreadPool::defaultThreadCount()
+{
+  if (defaultThreads>0) return defaultThreads;
+  const int n = (int)std::thread::hardware_concurrency();
+  return (n>0) ? n : 1;
+}
+
+ThreadPool &ThreadPool::global()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+ThreadPool::ThreadPool(int nThreads_) :
+  nThreads((nThreads_>0) ? nThreads_ : defaultThreadCount()),
+  job(nullptr), jobTasks(0), nextTask(0), active(0), generation(0), stopping(false)
+{
+  for (int i=1;i<nThreads;i++)
+    workers.emplace_back(&ThreadPool::workerLoop,this,i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &w : workers) w.join();
+}
+
+void ThreadPool::execute(const int worker)
+{
+  insidePoolTask = true;
+  for (int task=nextTask++; task<jobTasks; task=nextTask++)
+    (*job)(task,worker);
+  insidePoolTask = false;
+}
+
+void ThreadPool::workerLoop(const int worker)
+{
+  size_t seen = 0;
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock,[&]{ return stopping || generation!=seen; });
+      if (stopping) return;
+      seen = generation;
+    }
+    execute(worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active==0) done.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run(const int nTasks, const Task &fn)
+{
+  if (nTasks<=0) return;
+  if (nThreads==1 || nTasks==1 || insidePoolTask)
+  {
+    for (int task=0;task<nTasks;task++) fn(task,0);
+    return;
+  }
+  std::lock_guard<std::mutex> runLock(runMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &fn;
+    jobTasks = nTasks;
+    nextTask = 0;
+    active = nThreads-1;
+    generation++;
+  }
+  wake.notify_all();
+  execute(0);
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock,[&]{ return active==0; });
+  job = nullptr;
+}
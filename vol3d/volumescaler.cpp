@@ -47,168 +47,97 @@ double VolumeScaler::scaleToUint8(Vol3D<uint8> &vb, const Vol3D<uint8> &vIn)
   return 1.0;
 }
 
-template <class FloatT>
-double VolumeScaler::scaleToUint8_16bit(Vol3D<uint8> &vb, const Vol3D<FloatT> &vf)
-// assumes equivalent of 16-bit range of values stored in float, e.g., a uint16 file was saved as float
+namespace {
+
+// Value below which 99.9% of the voxels of v fall, from a 16-bit histogram of bin(v[i]); if it
+// is zero, 1 is returned instead, with a warning if warnIfZero is set.
+template <class T, class Bin>
+int clippedMaximum(const Vol3D<T> &v, const Bin bin, const bool warnIfZero)
 {
-  std::vector<int> hgram(65536);
-  for (int i=0;i<65536;i++) hgram[i] = 0;
-  const int ds = vf.size();
-  for (int i=0;i<ds;i++) hgram[u16clamp(vf[i])]++;
-  int limit = (int)(ds * 0.999);
+  std::vector<int> hgram(65536,0);
+  const int ds = v.size();
+  for (int i=0;i<ds;i++) hgram[bin(v[i])]++;
+  int limit = (int)(ds * 0.999); // take lower 99.9%
   int maxval = 65536;
   int sum = 0;
   for (int i=0;i<65536;i++) { if ((sum+=hgram[i])>limit) { maxval = i; break; } }
-  vb.makeCompatible(vf);
-  uint8 *d = vb.start();
   if (maxval==0)
   {
-    std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
+    if (warnIfZero) std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
     maxval = 1;
   }
+  return maxval;
+}
+
+// Value of vf that is mapped to 255. Floats up to 65535 are binned directly (e.g., a uint16 file
+// saved as float); larger ranges are first scaled to 16 bits.
+template <class FloatT>
+FloatT floatClippedMaximum(const Vol3D<FloatT> &vf, const bool warnIfZero)
+{
+  const FloatT maxValue = *std::max_element(vf.cbegin(),vf.cend());
+  const FloatT scale = (maxValue<65536) ? 1 : 65535/maxValue;
+  const int maxval = clippedMaximum(vf,[scale](const FloatT f) { return VolumeScaler::u16clamp(f*scale); },warnIfZero);
+  return maxval / scale;
+}
+
+// maps [0,maxval] of v to [0,255], saturating above maxval, and returns the scale factor
+template <class T, class MaxT>
+double applyScale(Vol3D<uint8> &vb, const Vol3D<T> &v, const MaxT maxval)
+{
+  vb.makeCompatible(v);
+  uint8 *d = vb.start();
+  const int ds = v.size();
   for (int i=0;i<ds;i++)
   {
-    int v = (int)((vf[i] * 255)/maxval);
-    d[i] = (v<255) ? v : 255;
+    int value = (int)((v[i] * 255)/maxval);
+    d[i] = (value<255) ? value : 255;
   }
   return 255.0/maxval;
 }
 
+}
+
+template <class FloatT>
+double VolumeScaler::scaleToUint8_16bit(Vol3D<uint8> &vb, const Vol3D<FloatT> &vf)
+// assumes equivalent of 16-bit range of values stored in float, e.g., a uint16 file was saved as float
+{
+  return applyScale(vb,vf,clippedMaximum(vf,[](const FloatT f) { return u16clamp(f); },true));
+}
+
 double VolumeScaler::scaleToUint8(Vol3D<uint8> &vb, const Vol3D<float32> &vf)
 // float32 and float64 should use the same method
 {
-  const float32 maxValue = *std::max_element(vf.cbegin(),vf.cend());
-  if (maxValue<65536) return scaleToUint8_16bit(vb,vf);
-  if (maxValue>0)
-  {
-    const float32 scale = 65535/(maxValue);
-    std::vector<int> hgram(65536);
-    for (int i=0;i<65536;i++) hgram[i] = 0;
-    const int ds = vf.size();
-    for (int i=0;i<ds;i++) hgram[u16clamp(vf[i]*scale)]++;
-    int limit = (int)(ds * 0.999);
-    int maxval = 65536;
-    int sum = 0;
-    for (int i=0;i<65536;i++) { if ((sum+=hgram[i])>limit) { maxval = i; break; } }
-    vb.makeCompatible(vf);
-    uint8 *d = vb.start();
-    if (maxval==0)
-    {
-      std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-      maxval = 1;
-    }
-    const float32 rescale = maxval / scale;
-    for (int i=0;i<ds;i++)
-    {
-      int v = (int)((vf[i] * 255)/rescale);
-      d[i] = (v<255) ? v : 255;
-    }
-    return 255.0/rescale;
-  }
-  else
-  {
-    std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-    vb.makeCompatible(vf);
-    vb.set(0);
-    return 1.0;
-  }
+  return applyScale(vb,vf,floatClippedMaximum(vf,true));
 }
 
 double VolumeScaler::scaleToUint8(Vol3D<uint8> &vb, const Vol3D<float64> &vf)
 // float32 and float64 should use the same method
-{    
-  const float64 maxValue = *std::max_element(vf.begin(),vf.end());
-  if (maxValue<65536) return scaleToUint8_16bit(vb,vf);
-  if (maxValue>0)
-  {
-    const float64 scale = 65535/(maxValue);
-    std::vector<int> hgram(65536);
-    for (int i=0;i<65536;i++) hgram[i] = 0;
-    const int ds = vf.size();
-    for (int i=0;i<ds;i++) hgram[u16clamp(vf[i]*scale)]++;
-    int limit = (int)(ds * 0.999);
-    int maxval = 65536;
-    int sum = 0;
-    for (int i=0;i<65536;i++) { if ((sum+=hgram[i])>limit) { maxval = i; break; } }
-    vb.makeCompatible(vf);
-    uint8 *d = vb.start();
-    if (maxval==0)
-    {
-      std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-      maxval = 1;
-    }
-    const float64 rescale = maxval / scale;
-    for (int i=0;i<ds;i++)
-    {
-      int v = (int)((vf[i] * 255)/rescale);
-      d[i] = (v<255) ? v : 255;
-    }
-    return 255.0/rescale;
-  }
-  else
-  {
-    std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-    vb.makeCompatible(vf);
-    vb.set(0);
-    return 1.0;
-  }
+{
+  return applyScale(vb,vf,floatClippedMaximum(vf,true));
 }
 
 double VolumeScaler::scaleToUint8(Vol3D<uint8> &vb, const Vol3D<uint16> &vs)
 {
-  std::vector<int> hgram(65536);
-  for (int i=0;i<65536;i++) hgram[i] = 0;
-  const int ds = vs.size();
-  unsigned short *s = (unsigned short *)vs.start();
-  for (int i=0;i<ds;i++) hgram[s[i]]++;
-  int limit = (int)(ds * 0.999); // take lower 99.9%
-  int maxval = 65536;
-  int sum = 0;
-  for (int i=0;i<65536;i++) { if ((sum+=hgram[i])>limit) { maxval = i; break; } }
-  vb.makeCompatible(vs);
-  uint8 *d = vb.start();
-  if (maxval==0)
-  {
-    std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-    maxval = 1;
-  }
-  for (int i=0;i<ds;i++)
-  {
-    int v = (s[i] * 255)/maxval;
-    d[i] = (v<255) ? v : 255;
-  }
-  return 255.0/maxval;
+  return applyScale(vb,vs,clippedMaximum(vs,[](const uint16 s) { return s; },true));
 }
 
 double VolumeScaler::scaleToUint8(Vol3D<uint8> &vb, const Vol3D<sint16> &vs)
 {
-  std::vector<int> hgram(37268);
-  for (int i=0;i<37268;i++) hgram[i] = 0;
-  const int ds = vs.size();
-  const auto *s = vs.start();
-  for (int i=0;i<ds;i++)
-  {
-    hgram[(s[i]>0) ? s[i] : 0 ]++;
-  }
-  int limit = (int)(ds * 0.999); // take lower 99.9%
-  int maxval = 32767;
-  int sum = 0;
-  for (int i=0;i<32768;i++) { if ((sum+=hgram[i])>limit) { maxval = i; break; } }
-  vb.makeCompatible(vs);
-  uint8 *d = vb.start();
-  if (maxval==0)
-  {
-    std::cerr<<"Warning: maximum value of image is zero!"<<std::endl;
-    maxval = 1;
-  }
-  for (int i=0;i<ds;i++)
-  {
-    int v = (s[i] * 255)/maxval;
-    d[i] = (v<255) ? v : 255;
-  }
-  return 255.0/maxval;
+  return applyScale(vb,vs,clippedMaximum(vs,[](const sint16 s) { return (s>0) ? s : 0; },true));
+}
+
+double VolumeScaler::uint8Scale(const Vol3D<uint16> &vs)
+{
+  return 255.0/clippedMaximum(vs,[](const uint16 s) { return s; },false);
+}
+
+double VolumeScaler::uint8Scale(const Vol3D<float32> &vf)
+{
+  return 255.0/floatClippedMaximum(vf,false);
 }
 
+template double VolumeScaler::scaleToUint8_16bit(Vol3D<uint8> &vb, const Vol3D<float32> &vf);
+template double VolumeScaler::scaleToUint8_16bit(Vol3D<uint8> &vb, const Vol3D<float64> &vf);
 template double VolumeScaler::scaleToUint8Masked(Vol3D<uint8> &vb, const Vol3D<float64> &vIn, const Vol3D<uint8> &vm);
 template double VolumeScaler::scaleToUint8Masked(Vol3D<uint8> &vb, const Vol3D<float32> &vIn, const Vol3D<uint8> &vm);
 template double VolumeScaler::scaleToUint8Masked(Vol3D<uint8> &vb, const Vol3D<uint16> &vIn, const Vol3D<uint8> &vm);